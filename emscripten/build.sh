@@ -1,9 +1,12 @@
+# -msimd128 enables WebAssembly SIMD (supported by all current browsers),
+# which models/hex.cpp uses for hex decoding and encoding
 emcc \
     emscripten/index.cpp \
     lib/nanovg/nanovg.c \
     src/app.cpp \
     src/utils/animation.cpp \
     src/utils/timer.cpp \
+    src/utils/worker_pool.cpp \
     src/utils/text_rendering.cpp \
     src/views/Root.cpp \
     src/views/LoginView.cpp \
@@ -19,15 +22,20 @@ emcc \
     src/views/ScrollView.cpp \
     src/models/keys.cpp \
     src/models/event.cpp \
+    src/models/verified_ids.cpp \
     src/models/event_parse.cpp \
     src/models/relay_message.cpp \
     src/models/client_message.cpp \
+    src/models/filters.cpp \
     src/models/event_stringify.cpp \
     src/models/event_content.cpp \
     src/models/profile.cpp \
     src/models/hex.cpp \
     src/models/nostr_entity.cpp \
     src/models/nip04.cpp \
+    src/models/shared_secrets.cpp \
+    src/models/aes_cbc.cpp \
+    src/models/base64.cpp \
     src/models/nip31.cpp \
     src/models/account.cpp \
     src/models/c/aes.c \
@@ -38,6 +46,8 @@ emcc \
     src/network/network.cpp \
     src/data_layer/accounts.cpp \
     src/data_layer/events.cpp \
+    src/data_layer/event_log.cpp \
+    src/data_layer/event_index.cpp \
     src/data_layer/relays.cpp \
     src/data_layer/conversations.cpp \
     src/data_layer/profiles.cpp \
@@ -47,6 +57,7 @@ emcc \
     -I lib/ \
     -I lib/rapidjson/include/ \
     -I lib/secp256k1/include/ \
+    -msimd128 \
     -o emscripten/index.js \
     --embed-file assets/SFBold.ttf \
     --embed-file assets/SFRegular.ttf \
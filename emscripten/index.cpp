@@ -297,7 +297,7 @@ EM_BOOL websocket_message_event(int event_type, const EmscriptenWebSocketMessage
     AppWebsocketEvent app_event;
     app_event.type = WEBSOCKET_MESSAGE;
     app_event.socket = event->socket;
-    app_event.data = (const char*)event->data;
+    app_event.data = (char*)event->data;
     app_event.data_length = event->data ? strlen((const char*)event->data) : 0;
     app_event.user_data = user_data;
     app_websocket_event(&app_event);
@@ -318,8 +318,10 @@ EM_BOOL websocket_close_event(int event_type, const EmscriptenWebSocketCloseEven
     app_event.type = WEBSOCKET_CLOSE;
     app_event.socket = event->socket;
     app_event.code = event->code;
-    app_event.data = event->reason;
-    app_event.data_length = strlen(event->reason);
+    char reason[sizeof(event->reason)];
+    memcpy(reason, event->reason, sizeof(reason));
+    app_event.data = reason;
+    app_event.data_length = strlen(reason);
     app_event.user_data = user_data;
     app_websocket_event(&app_event);
     return 1;
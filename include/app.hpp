@@ -14,7 +14,7 @@
 
 namespace app {
 
-// Set immediate
+// Set immediate (safe to call from any thread)
 void set_immediate(std::function<void()> callback);
 
 // Storage
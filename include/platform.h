@@ -133,7 +133,11 @@ typedef struct {
     AppWebsocketHandle socket;
     void* user_data;
     unsigned short code;
-    const char* data;
+    // For WEBSOCKET_MESSAGE events, data is a NUL terminated copy of the
+    // message that is only valid for the duration of the callback. The app
+    // is allowed to modify it in place (it gets parsed in-situ), so the
+    // platform has to hand over a buffer it doesn't mind being changed.
+    char* data;
     int data_length;
 } AppWebsocketEvent;
 
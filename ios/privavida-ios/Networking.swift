@@ -187,14 +187,15 @@ class WebSocketHandle: WebSocketDelegate {
             Networking.sharedInstance.websocketRemove(ws: self.id)
 
         case .text(let txt):
-            let cString = txt.utf8CString
-            cString.withUnsafeBytes { ptr in
+            // The core parses the message in place, so we hand it a mutable copy
+            var cString = txt.utf8CString
+            cString.withUnsafeMutableBufferPointer { ptr in
                 var event = AppWebsocketEvent()
                 event.type = WEBSOCKET_MESSAGE
                 event.socket = self.id
                 event.user_data = userData
-                event.data = unsafeBitCast(ptr.baseAddress, to: UnsafePointer<Int8>.self)
-                event.data_length = Int32(strlen(event.data))
+                event.data = ptr.baseAddress
+                event.data_length = Int32(ptr.count - 1)
                 app_websocket_event(&event)
             }
 
@@ -14,10 +14,17 @@
 #include <string.h>
 #include "utils/animation.hpp"
 #include "utils/timer.hpp"
+#include "utils/worker_pool.hpp"
+#include "models/relay_message.hpp"
+#include "models/hex.hpp"
+#include "models/base64.hpp"
 #include "utils/text_rendering.hpp"
 #include "views/Root.hpp"
+#include <atomic>
+#include <mutex>
 
-static bool redraw_requested;
+// Can be set from the worker threads (see app::set_immediate)
+static std::atomic<bool> redraw_requested;
 
 static void process_immediate_callbacks();
 static void process_touch_queue();
@@ -32,6 +39,12 @@ void app_init(NVGcontext* vg_) {
     ui::text_rendering_init();
     ui::vg = vg_;
     timer::init();
+    worker_pool::init();
+#ifdef PRIVAVIDA_BENCHMARKS
+    hex_benchmark();
+    base64_benchmark();
+    relay_message_benchmark(app::get_user_data_path("relay_traffic.txt"));
+#endif
 
     // nvgCreateFont(vg_, "mono",     app::get_asset_name("PTMono",          "ttf"));
     nvgCreateFont(vg_, "regular",  app::get_asset_name("SFRegular",       "ttf"));
@@ -91,14 +104,24 @@ void ui::redraw() {
     redraw_requested = true;
 }
 
+// set_immediate() is the one function that can be called from any
+// thread (the worker pool posts its results back through it), so the
+// callback queue is protected by a mutex
+static std::mutex immediate_callbacks_mutex;
 static std::vector<std::function<void()>> immediate_callbacks;
 void app::set_immediate(std::function<void()> callback) {
-    immediate_callbacks.push_back(std::move(callback));
+    {
+        std::lock_guard<std::mutex> lock(immediate_callbacks_mutex);
+        immediate_callbacks.push_back(std::move(callback));
+    }
     ui::redraw();
 }
 void process_immediate_callbacks() {
     static std::vector<std::function<void()>> immediate_callbacks_copy;
-    std::swap(immediate_callbacks_copy, immediate_callbacks);
+    {
+        std::lock_guard<std::mutex> lock(immediate_callbacks_mutex);
+        std::swap(immediate_callbacks_copy, immediate_callbacks);
+    }
     for (auto& fn : immediate_callbacks_copy) {
         fn();
     }
@@ -8,12 +8,15 @@
 #include "accounts.hpp"
 #include "relays.hpp"
 #include "profiles.hpp"
+#include "events.hpp"
 #include "../models/hex.hpp"
+#include "../models/shared_secrets.hpp"
 #include "../network/network.hpp"
 #include <app.hpp>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 namespace data_layer {
 
@@ -21,12 +24,186 @@ constexpr auto ACCOUNT_FILE = "account0.bin";
 static int account_selected = -1;
 static std::vector<Account> accounts;
 
+// How far each of the subscriptions has been synced with each relay.
+// Once a request gets to its EOSE we have every matching event the relay
+// had when we sent it, so the next request only has to ask for what was
+// created since then. Until the EOSE arrives the cursor stays put, as
+// relays send the newest events first and an interrupted backfill would
+// otherwise leave a gap of older events behind.
+//
+// A cursor is stored a few minutes before the time the request was sent,
+// as events can reach a relay after our EOSE with an earlier created_at
+// (the author's clock is off, or they took a while to propagate). When
+// it's used, it's clamped to the newest matching event we actually hold,
+// so that events the event log lost since (or the whole log, if it was
+// deleted) are requested again. The overlap costs little, as events we
+// already hold are dropped before they're verified.
+//
+// The cursors are kept per account, in sync_<pubkey prefix>.bin.
+constexpr int64_t SYNC_CURSOR_OVERLAP_SECONDS = 5 * 60;
+
+struct SyncCursor {
+    uint64_t filters_hash;
+    int64_t since;
+    int32_t relay_id;
+    uint32_t reserved;
+};
+static std::vector<SyncCursor> sync_cursors;
+static char sync_cursors_file_name[32];
+
+static uint64_t hash_filters(const Filters* filters) {
+    uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+    auto data = (const uint8_t*)filters;
+    for (uint32_t i = 0; i < Filters::size_of(filters); ++i) {
+        hash = (hash ^ data[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static void load_sync_cursors(const Account* account) {
+    char pubkey_hex[17];
+    hex_encode(pubkey_hex, account->pubkey.data, 8);
+    pubkey_hex[16] = '\0';
+    snprintf(sync_cursors_file_name, sizeof(sync_cursors_file_name), "sync_%s.bin", pubkey_hex);
+
+    sync_cursors.clear();
+    FILE* f = fopen(app::get_user_data_path(sync_cursors_file_name), "rb");
+    if (!f) return;
+
+    SyncCursor cursor;
+    while (fread(&cursor, sizeof(cursor), 1, f) == 1) {
+        sync_cursors.push_back(cursor);
+    }
+    fclose(f);
+}
+
+static void save_sync_cursors() {
+    auto file_name = app::get_user_data_path(sync_cursors_file_name);
+    FILE* f = fopen(file_name, "wb");
+    if (!f) {
+        printf("Failed to create file: '%s'\n", file_name);
+        return;
+    }
+    fwrite(sync_cursors.data(), sizeof(SyncCursor), sync_cursors.size(), f);
+    fclose(f);
+    app::user_data_flush();
+}
+
+// Returns -1 if we've never synced the filters with the relay
+static int64_t get_sync_cursor(uint64_t filters_hash, RelayId relay_id) {
+    for (auto& cursor : sync_cursors) {
+        if (cursor.filters_hash == filters_hash && cursor.relay_id == relay_id) {
+            return cursor.since;
+        }
+    }
+    return -1;
+}
+
+static void set_sync_cursor(uint64_t filters_hash, RelayId relay_id, int64_t since) {
+    SyncCursor* cursor = NULL;
+    for (auto& other : sync_cursors) {
+        if (other.filters_hash == filters_hash && other.relay_id == relay_id) {
+            cursor = &other;
+        }
+    }
+    if (!cursor) {
+        sync_cursors.push_back(SyncCursor());
+        cursor = &sync_cursors.back();
+        cursor->filters_hash = filters_hash;
+        cursor->relay_id = relay_id;
+        cursor->reserved = 0;
+    } else if (cursor->since >= since) {
+        return;
+    }
+    cursor->since = since;
+    save_sync_cursors();
+}
+
+// Returns -1 if we don't hold any events matching the filters
+static int64_t newest_stored_created_at(const Filters* filters) {
+    StackBufferFixed<128> filters_newest_buffer;
+    filters_newest_buffer.reserve(Filters::size_of(filters));
+    memcpy(filters_newest_buffer.data, filters, Filters::size_of(filters));
+
+    auto filters_newest = (Filters*)filters_newest_buffer.data;
+    filters_newest->since = -1;
+    filters_newest->until = -1;
+    filters_newest->limit = 1;
+
+    std::vector<EventLocator> results;
+    query_events(filters_newest, &results);
+    return results.empty() ? -1 : (int64_t)event(results.back())->created_at;
+}
+
+// Requests everything matching the filters that we don't have yet, and
+// keeps a stream open for new events. If we've synced these filters with
+// a relay before, we only ask it for what was created since then
+// (falling back to a full sync otherwise).
+//
+// The stream goes to every relay, so we don't miss anything live, but
+// the request only goes to the REQUEST_RELAYS best relays. Relays we've
+// synced with before come first (they hold the data), then they're
+// ordered by network::rank_relays().
+constexpr uint32_t REQUEST_RELAYS = 2;
+
+static void subscribe(const Filters* filters) {
+    auto default_relays = get_default_relays();
+    std::vector<RelayId> relays(default_relays.begin(), default_relays.end());
+    network::rank_relays(relays.data(), (uint32_t)relays.size());
+
+    auto filters_hash = hash_filters(filters);
+    int64_t request_time = (int64_t)time(NULL);
+
+    int64_t newest_stored = newest_stored_created_at(filters);
+    std::vector<int64_t> since(relays.size());
+    for (int i = 0; i < relays.size(); ++i) {
+        since[i] = get_sync_cursor(filters_hash, relays[i]);
+        if (since[i] > newest_stored) {
+            since[i] = newest_stored;
+        }
+    }
+
+    uint32_t num_requested = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        bool holds_data = pass == 0;
+        for (int i = 0; i < relays.size() && num_requested < REQUEST_RELAYS; ++i) {
+            if ((since[i] != -1) != holds_data) continue;
+
+            StackBufferFixed<128> filters_since_buffer;
+            filters_since_buffer.reserve(Filters::size_of(filters));
+            memcpy(filters_since_buffer.data, filters, Filters::size_of(filters));
+
+            auto filters_since = (Filters*)filters_since_buffer.data;
+            filters_since->since = since[i];
+
+            auto relay_id = relays[i];
+            network::relay_add_task_request(relay_id, filters_since, [filters_hash, relay_id, request_time](double seconds) {
+                set_sync_cursor(filters_hash, relay_id, request_time - SYNC_CURSOR_OVERLAP_SECONDS);
+            });
+            num_requested++;
+        }
+    }
+
+    for (auto relay_id : relays) {
+        network::relay_add_task_stream(relay_id, filters);
+    }
+}
+
 static void open_default_subscriptions() {
     network::stop_all_tasks();
     
     auto account = current_account();
     if (!account) return;
-    
+
+    // Load the profiles and events we've already stored before
+    // subscribing. This has to happen after stop_all_tasks() as loading
+    // the events can queue up profile requests (which we want batched
+    // together).
+    data_layer::batch_profile_requests();
+    data_layer::load_profiles();
+    data_layer::load_events();
+    load_sync_cursors(account);
+
     StackBufferFixed<128> filters_buffer;
 
     // "dms_sent" subscription
@@ -35,11 +212,7 @@ static void open_default_subscriptions() {
             .kind(4)
             .author(&account->pubkey)
             .finish();
-
-        for (auto relay_id : get_default_relays()) {
-            network::relay_add_task_request(relay_id, filters);
-            network::relay_add_task_stream(relay_id, filters);
-        }
+        subscribe(filters);
     }
 
     // "dms_received" subscription
@@ -48,11 +221,7 @@ static void open_default_subscriptions() {
             .kind(4)
             .p_tag(&account->pubkey)
             .finish();
-
-        for (auto relay_id : get_default_relays()) {
-            network::relay_add_task_request(relay_id, filters);
-            network::relay_add_task_stream(relay_id, filters);
-        }
+        subscribe(filters);
     }
 
     // "profile" subscription (fetches kind 0 metadata and kind 3 contact list)
@@ -62,11 +231,7 @@ static void open_default_subscriptions() {
             .kinds(2, kinds)
             .author(&account->pubkey)
             .finish();
-
-        for (auto relay_id : get_default_relays()) {
-            network::relay_add_task_request(relay_id, filters);
-            network::relay_add_task_stream(relay_id, filters);
-        }
+        subscribe(filters);
     }
 
     data_layer::batch_profile_requests();
@@ -142,6 +307,7 @@ bool open_account_with_pubkey(const Pubkey* pubkey) {
     if (!account_from_pubkey(&account, pubkey)) return false;
     if (!write_account(&account)) return false;
     accounts.clear();
+    shared_secrets_clear();
     accounts.push_back(std::move(account));
     account_selected = 0;
     open_default_subscriptions();
@@ -153,6 +319,7 @@ bool open_account_with_seckey(const Seckey* seckey) {
     if (!account_from_seckey(&account, seckey)) return false;
     if (!write_account(&account)) return false;
     accounts.clear();
+    shared_secrets_clear();
     accounts.push_back(std::move(account));
     account_selected = 0;
     open_default_subscriptions();
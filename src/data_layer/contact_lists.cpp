@@ -13,27 +13,14 @@
 
 namespace data_layer {
 
-std::vector<EventLocator> contact_lists;
-
 void receive_contact_list(EventLocator event_loc) {
 
     auto event = data_layer::event(event_loc);
 
-    // Add the contact list
-    bool replaced_older = false;
-    for (auto i = 0; i < contact_lists.size(); ++i) {
-        auto other_event = data_layer::event(contact_lists[i]);
-        if (compare_keys(&other_event->pubkey, &event->pubkey)) {
-            if (other_event->created_at > event->created_at) {
-                return;
-            }
-            contact_lists[i] = event_loc;
-            replaced_older = true;
-            break;
-        }
-    }
-    if (!replaced_older) {
-        contact_lists.push_back(event_loc);
+    // The event store keeps every contact list, and only the
+    // newest one of each author counts
+    if (find_newest_event(&event->pubkey, 3) != event_loc) {
+        return;
     }
 
     // Is it our contact list?
@@ -49,13 +36,7 @@ void receive_contact_list(EventLocator event_loc) {
 }
 
 const Event* get_contact_list(const Pubkey* pubkey) {
-    for (auto event_loc : contact_lists) {
-        auto event = data_layer::event(event_loc);
-        if (compare_keys(&event->pubkey, pubkey)) {
-            return event;
-        }
-    }
-    return NULL;
+    return data_layer::event(find_newest_event(pubkey, 3));
 }
 
 bool does_first_follow_second(const Pubkey* first, const Pubkey* second) {
@@ -13,6 +13,7 @@
 #include "../models/event_content.hpp"
 #include "../models/nip31.hpp"
 #include "../network/network.hpp"
+#include "../utils/key_table.hpp"
 #include <stdio.h>
 #include <vector>
 #include <algorithm>
@@ -22,39 +23,67 @@ namespace data_layer {
 std::vector<Conversation> conversations;
 std::vector<int> conversations_sorted;
 
-static bool sort_by_created_at(const Message& a, const Message& b) {
-    return data_layer::event(a.event_loc)->created_at < data_layer::event(b.event_loc)->created_at;
-}
+// Maps both the counterparties and their (NIP-31) aliases to the
+// conversation they're in
+static KeyTable<Pubkey, int> conversations_by_pubkey;
 
-static bool sort_conv_by_last_active_time(int a, int b) {
-    return conversations[a].last_active_time < conversations[b].last_active_time;
+static int find_conversation(const Pubkey* pubkey) {
+    auto conversation_id = conversations_by_pubkey.find(pubkey);
+    return conversation_id ? *conversation_id : -1;
 }
 
 static Conversation* get_or_create_conversation(Pubkey counterparty) {
-    for (int i = 0; i < conversations.size(); ++i) {
-        if (compare_keys(&conversations[i].counterparty, &counterparty)) {
-            return &conversations[i];
-        }
+    int conversation_id = find_conversation(&counterparty);
+    if (conversation_id != -1) {
+        return &conversations[conversation_id];
     }
 
     conversations.push_back(data_layer::Conversation());
     auto& conv = conversations.back();
     conv.counterparty = counterparty;
-
-    int conversation_id = (int)conversations.size() - 1;
-    conversations_sorted.push_back(conversation_id);
+    conversations_by_pubkey.insert(&counterparty, (int)conversations.size() - 1);
     return &conv;
 }
 
-void receive_direct_message(EventLocator event_loc) {
+static void remove_from_sorted(int conversation_id) {
+    auto it = std::find(conversations_sorted.begin(), conversations_sorted.end(), conversation_id);
+    if (it != conversations_sorted.end()) {
+        conversations_sorted.erase(it);
+    }
+}
 
-    auto event = data_layer::event(event_loc);
+// Moves the conversation to its place in conversations_sorted (adding it
+// if it isn't in there yet). The conversation that's moving is usually
+// one of the most recently active ones, so we look from the end.
+static void sort_conversation(int conversation_id) {
+    auto it = std::find(conversations_sorted.rbegin(), conversations_sorted.rend(), conversation_id);
+    if (it != conversations_sorted.rend()) {
+        conversations_sorted.erase(std::next(it).base());
+    }
 
-    Conversation* conv;
-    Message message;
-    message.event_loc = event_loc;
+    auto last_active_time = conversations[conversation_id].last_active_time;
+    auto position = std::upper_bound(conversations_sorted.begin(), conversations_sorted.end(), last_active_time,
+        [](uint64_t time, int other_id) { return time < conversations[other_id].last_active_time; });
+    conversations_sorted.insert(position, conversation_id);
+}
+
+// Who the direct message is with, going by its metadata alone (so
+// this works before the content has been decrypted)
+static bool direct_message_counterparty(const Event* event, Pubkey* counterparty_out) {
+    if (!event->p_tags.size) return false; // Malformed direct message
+
+    if (compare_keys(&event->pubkey, &data_layer::current_account()->pubkey)) {
+        *counterparty_out = event->p_tags.get(event, 0).pubkey;
+    } else {
+        *counterparty_out = event->pubkey;
+    }
+    return true;
+}
+
+// Does the (decrypted) message content contain a valid invite?
+static const NostrEntity* find_invite(const Event* event) {
+    if (event->content_encryption != EVENT_CONTENT_DECRYPTED) return NULL;
 
-    // Does the message content contain an invite?
     const NostrEntity* invite = NULL;
     for (auto& token : event->content_tokens.get(event)) {
         if (token.type == EventContentToken::ENTITY &&
@@ -63,40 +92,123 @@ void receive_direct_message(EventLocator event_loc) {
         }
     }
     if (invite && nip31_verify_invite(const_cast<NostrEntity*>(invite), &event->p_tags.get(event, 0).pubkey)) {
-        message.type = Message::INVITE;
-        conv = get_or_create_conversation(invite->pubkey);
+        return invite;
+    }
+    return NULL;
+}
 
-        Pubkey alias = *invite->invite_conversation_pubkey.get(invite);
+// Messages mostly arrive in order, so this is almost always an append
+static void add_message(Conversation* conv, Message message) {
+    auto position = std::upper_bound(conv->messages.begin(), conv->messages.end(), message.created_at,
+        [](uint64_t created_at, const Message& other) { return created_at < other.created_at; });
+    conv->messages.insert(position, message);
+    conv->version++;
 
-        bool alias_already_known = false;
-        for (auto& other_alias : conv->aliases) {
-            if (compare_keys(&alias, &other_alias)) {
-                alias_already_known = true;
-                break;
-            }
-        }
-        if (alias_already_known) return; // Don't need this invite message
+    if (conv->messages.size() == 1 || conv->messages.back().created_at != conv->last_active_time) {
+        conv->last_active_time = conv->messages.back().created_at;
+        sort_conversation((int)(conv - conversations.data()));
+    }
+}
 
-        conv->aliases.push_back(*invite->invite_conversation_pubkey.get(invite));
+// Moves all messages of one conversation into another
+static void merge_conversation(int from_id, int into_id) {
+    auto& from = conversations[from_id];
+    auto& into = conversations[into_id];
 
+    for (auto& message : from.messages) {
+        add_message(&into, message);
+    }
+
+    from.messages.clear();
+    from.version++;
+    remove_from_sorted(from_id);
+}
+
+static void receive_invite(EventLocator event_loc, const NostrEntity* invite) {
+    auto conv = get_or_create_conversation(invite->pubkey);
+    int conversation_id = (int)(conv - conversations.data());
+
+    Pubkey alias = *invite->invite_conversation_pubkey.get(invite);
+    int alias_conversation_id = find_conversation(&alias);
+    if (alias_conversation_id == conversation_id) {
+        return; // Don't need this invite message
+    }
+    conv->aliases.push_back(alias);
+    conversations_by_pubkey.insert(&alias, conversation_id);
+
+    // Messages with the alias may have arrived before the invite did
+    if (alias_conversation_id != -1) {
+        merge_conversation(alias_conversation_id, conversation_id);
+    }
+
+    Message message;
+    message.type = Message::INVITE;
+    message.event_loc = event_loc;
+    message.created_at = data_layer::event(event_loc)->created_at;
+    add_message(conv, message);
+}
+
+void clear_conversations() {
+    conversations.clear();
+    conversations_sorted.clear();
+    conversations_by_pubkey.clear();
+    ui::redraw();
+}
+
+void receive_direct_message(EventLocator event_loc) {
+
+    auto event = data_layer::event(event_loc);
+
+    auto invite = find_invite(event);
+    if (invite) {
+        receive_invite(event_loc, invite);
     } else {
+        Pubkey counterparty;
+        if (!direct_message_counterparty(event, &counterparty)) return;
+        auto conv = get_or_create_conversation(counterparty);
+
+        Message message;
         message.type = Message::DIRECT_MESSAGE;
-        if (!event->p_tags.size) return; // Malformed direct message
+        message.event_loc = event_loc;
+        message.created_at = event->created_at;
+        add_message(conv, message);
+    }
 
-        Pubkey counterparty;
-        if (compare_keys(&event->pubkey, &data_layer::current_account()->pubkey)) {
-            counterparty = event->p_tags.get(event, 0).pubkey;
+    ui::redraw();
+}
+
+void receive_direct_message_decrypted(EventLocator event_loc) {
+
+    auto event = data_layer::event(event_loc);
+
+    Pubkey counterparty;
+    if (!direct_message_counterparty(event, &counterparty)) return;
+    int conversation_id = find_conversation(&counterparty);
+    if (conversation_id == -1) return;
+
+    auto& conv = conversations[conversation_id];
+
+    // Now that we can see the content it may turn out to be an
+    // invite, which belongs in the inviting conversation instead
+    auto invite = find_invite(event);
+    if (invite) {
+        for (int i = 0; i < conv.messages.size(); ++i) {
+            if (conv.messages[i].event_loc == event_loc) {
+                conv.messages.erase(conv.messages.begin() + i);
+                conv.version++;
+                break;
+            }
+        }
+
+        if (conv.messages.empty()) {
+            remove_from_sorted(conversation_id);
         } else {
-            counterparty = event->pubkey;
+            conv.last_active_time = conv.messages.back().created_at;
+            sort_conversation(conversation_id);
         }
-        conv = get_or_create_conversation(counterparty);
-    }
 
-    // Add the message to the conversation
-    conv->messages.push_back(message);
-    std::sort(conv->messages.begin(), conv->messages.end(), &sort_by_created_at);
-    conv->last_active_time = data_layer::event(conv->messages.back().event_loc)->created_at;
-    std::sort(conversations_sorted.begin(), conversations_sorted.end(), &sort_conv_by_last_active_time);
+        receive_invite(event_loc, invite);
+    }
 
     ui::redraw();
 }
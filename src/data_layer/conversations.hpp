@@ -21,6 +21,7 @@ struct Message {
 
     Type type;
     EventLocator event_loc;
+    uint64_t created_at; // Of the event, which messages are ordered by
 };
 
 struct Conversation {
@@ -28,12 +29,23 @@ struct Conversation {
     std::vector<Pubkey> aliases;
     std::vector<Message> messages;
     uint64_t last_active_time;
+    uint32_t version = 0; // Bumped whenever messages are added or removed
 };
 
 extern std::vector<Conversation> conversations;
-extern std::vector<int> conversations_sorted;
+extern std::vector<int> conversations_sorted; // Non-empty ones, by last_active_time
 
+// Called (by events.cpp) when the event store is cleared
+void clear_conversations();
+
+// Direct messages are put into conversations going by their metadata,
+// before they've been decrypted. receive_direct_message_decrypted() is
+// called (by events.cpp) once one has been. Decrypting a message
+// doesn't change the conversation's version, as the message stays at
+// the same EventLocator.
 void receive_direct_message(EventLocator event_loc);
+void receive_direct_message_decrypted(EventLocator event_loc);
+
 void send_direct_message(int conversation_id, const char* message_text);
 
 }
@@ -0,0 +1,193 @@
+//
+//  event_index.cpp
+//  privavida-core
+//
+
+#include "event_index.hpp"
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "../utils/key_table.hpp"
+
+namespace data_layer {
+
+struct Bucket {
+    std::vector<EventIndexEntry> entries;
+    size_t num_sorted; // The entries after these were appended since
+};
+
+// An author's events are split up by kind, of which there are few
+struct AuthorKindBucket {
+    uint32_t kind;
+    int bucket_id;
+};
+
+static Bucket created_at_bucket;
+static std::vector<Bucket> buckets;
+static std::vector<std::vector<AuthorKindBucket>> author_kind_buckets;
+static KeyTable<Pubkey, int> authors; // Into author_kind_buckets
+static KeyTable<Pubkey, int> p_tags; // Into buckets
+static KeyTable<EventId, int> e_tags; // Into buckets
+
+static bool entry_before(const EventIndexEntry& a, const EventIndexEntry& b) {
+    if (a.created_at != b.created_at) return a.created_at < b.created_at;
+    return a.event_loc < b.event_loc;
+}
+
+static int create_bucket() {
+    buckets.emplace_back();
+    buckets.back().num_sorted = 0;
+    return (int)buckets.size() - 1;
+}
+
+template <typename K>
+static Bucket* find_bucket(KeyTable<K, int>* table, const K* key) {
+    auto bucket_id = table->find(key);
+    return bucket_id ? &buckets[*bucket_id] : NULL;
+}
+
+template <typename K>
+static Bucket* get_or_create_bucket(KeyTable<K, int>* table, const K* key) {
+    auto bucket_id = table->find(key);
+    if (bucket_id) {
+        return &buckets[*bucket_id];
+    }
+    int bucket_id_new = create_bucket();
+    table->insert(key, bucket_id_new);
+    return &buckets[bucket_id_new];
+}
+
+static Bucket* find_author_bucket(const Pubkey* author, uint32_t kind) {
+    auto author_id = authors.find(author);
+    if (!author_id) return NULL;
+    for (auto& kind_bucket : author_kind_buckets[*author_id]) {
+        if (kind_bucket.kind == kind) {
+            return &buckets[kind_bucket.bucket_id];
+        }
+    }
+    return NULL;
+}
+
+static Bucket* get_or_create_author_bucket(const Pubkey* author, uint32_t kind) {
+    auto bucket = find_author_bucket(author, kind);
+    if (bucket) return bucket;
+
+    int author_id;
+    auto author_id_found = authors.find(author);
+    if (author_id_found) {
+        author_id = *author_id_found;
+    } else {
+        author_id = (int)author_kind_buckets.size();
+        author_kind_buckets.emplace_back();
+        authors.insert(author, author_id);
+    }
+    AuthorKindBucket kind_bucket;
+    kind_bucket.kind = kind;
+    kind_bucket.bucket_id = create_bucket();
+    author_kind_buckets[author_id].push_back(kind_bucket);
+    return &buckets[kind_bucket.bucket_id];
+}
+
+static void append_entry(Bucket* bucket, EventLocator event_loc, uint64_t created_at) {
+    EventIndexEntry entry;
+    entry.created_at = created_at;
+    entry.event_loc = event_loc;
+    bucket->entries.push_back(entry);
+}
+
+// Sorts the entries appended since the last lookup and merges them in.
+// Backfills come in newest first and live events oldest first, so
+// neither is in any order relative to what's already there.
+static void sort_bucket(Bucket* bucket) {
+    auto& entries = bucket->entries;
+    if (bucket->num_sorted == entries.size()) return;
+
+    auto middle = entries.begin() + bucket->num_sorted;
+    std::sort(middle, entries.end(), &entry_before);
+    std::inplace_merge(entries.begin(), middle, entries.end(), &entry_before);
+    bucket->num_sorted = entries.size();
+}
+
+void event_index_insert(EventLocator event_loc, const Event* event) {
+    append_entry(&created_at_bucket, event_loc, event->created_at);
+    append_entry(get_or_create_author_bucket(&event->pubkey, event->kind), event_loc, event->created_at);
+
+    // An event tagging the same key more than once is only indexed
+    // once for it
+    auto event_p_tags = event->p_tags.get(event);
+    for (int i = 0; i < event_p_tags.size; ++i) {
+        bool seen = false;
+        for (int j = 0; j < i && !seen; ++j) {
+            seen = compare_keys(&event_p_tags[i].pubkey, &event_p_tags[j].pubkey);
+        }
+        if (!seen) {
+            append_entry(get_or_create_bucket(&p_tags, &event_p_tags[i].pubkey), event_loc, event->created_at);
+        }
+    }
+
+    auto event_e_tags = event->e_tags.get(event);
+    for (int i = 0; i < event_e_tags.size; ++i) {
+        bool seen = false;
+        for (int j = 0; j < i && !seen; ++j) {
+            seen = compare_keys(&event_e_tags[i].event_id, &event_e_tags[j].event_id);
+        }
+        if (!seen) {
+            append_entry(get_or_create_bucket(&e_tags, &event_e_tags[i].event_id), event_loc, event->created_at);
+        }
+    }
+}
+
+void event_index_clear() {
+    created_at_bucket.entries.clear();
+    created_at_bucket.num_sorted = 0;
+    buckets.clear();
+    author_kind_buckets.clear();
+    authors.clear();
+    p_tags.clear();
+    e_tags.clear();
+}
+
+Array<const EventIndexEntry> event_index_range(EventIndexType type, const uint8_t key[32], uint32_t kind, int64_t since, int64_t until) {
+    Bucket* bucket = NULL;
+    if (type == EVENT_INDEX_CREATED_AT) {
+        bucket = &created_at_bucket;
+    } else if (type == EVENT_INDEX_AUTHOR_KIND) {
+        Pubkey author;
+        memcpy(author.data, key, sizeof(author.data));
+        bucket = find_author_bucket(&author, kind);
+    } else if (type == EVENT_INDEX_P_TAG) {
+        Pubkey pubkey;
+        memcpy(pubkey.data, key, sizeof(pubkey.data));
+        bucket = find_bucket(&p_tags, &pubkey);
+    } else if (type == EVENT_INDEX_E_TAG) {
+        EventId event_id;
+        memcpy(event_id.data, key, sizeof(event_id.data));
+        bucket = find_bucket(&e_tags, &event_id);
+    }
+    if (!bucket) {
+        return Array<const EventIndexEntry>(0, NULL);
+    }
+    sort_bucket(bucket);
+
+    EventIndexEntry first, last;
+    first.created_at = since != -1 ? (uint64_t)since : 0;
+    first.event_loc = INT32_MIN;
+    last.created_at = until != -1 ? (uint64_t)until : UINT64_MAX;
+    last.event_loc = INT32_MAX;
+
+    auto& entries = bucket->entries;
+    auto begin = std::lower_bound(entries.begin(), entries.end(), first, &entry_before);
+    auto end = std::upper_bound(begin, entries.end(), last, &entry_before);
+    return Array<const EventIndexEntry>((uint32_t)(end - begin), entries.data() + (begin - entries.begin()));
+}
+
+void event_index_kinds(const Pubkey* author, std::vector<uint32_t>* kinds_out) {
+    kinds_out->clear();
+    auto author_id = authors.find(author);
+    if (!author_id) return;
+    for (auto& kind_bucket : author_kind_buckets[*author_id]) {
+        kinds_out->push_back(kind_bucket.kind);
+    }
+}
+
+}
@@ -0,0 +1,48 @@
+//
+//  event_index.hpp
+//  privavida-core
+//
+
+#pragma once
+#include "events.hpp"
+#include "../models/relative.hpp"
+
+// Secondary indexes over the stored events, kept up to date by the
+// event store as events get stored. Each key (and kind) has a bucket
+// of compact entries, which are appended as events come in and sorted
+// by created_at when they're next looked up, so storing an event never
+// moves the other entries around and a lookup is a binary search.
+//
+//     EVENT_INDEX_CREATED_AT:  every event (there's no key)
+//     EVENT_INDEX_AUTHOR_KIND: author pubkey + kind
+//     EVENT_INDEX_P_TAG:       each pubkey in the event's p tags
+//     EVENT_INDEX_E_TAG:       each event id in the event's e tags
+
+enum EventIndexType {
+    EVENT_INDEX_CREATED_AT,
+    EVENT_INDEX_AUTHOR_KIND,
+    EVENT_INDEX_P_TAG,
+    EVENT_INDEX_E_TAG
+};
+
+struct EventIndexEntry {
+    uint64_t created_at;
+    EventLocator event_loc;
+};
+
+namespace data_layer {
+
+void event_index_insert(EventLocator event_loc, const Event* event);
+void event_index_clear();
+
+// Gives the entries for the key (and kind) that were created within
+// [since, until], ordered by created_at, where either bound can be -1
+// to leave it open. The key is ignored for EVENT_INDEX_CREATED_AT, as
+// is the kind for all but EVENT_INDEX_AUTHOR_KIND. The range is only
+// valid until the next event gets stored.
+Array<const EventIndexEntry> event_index_range(EventIndexType type, const uint8_t key[32], uint32_t kind, int64_t since, int64_t until);
+
+// Gives the kinds there are stored events of by the author
+void event_index_kinds(const Pubkey* author, std::vector<uint32_t>* kinds_out);
+
+}
@@ -0,0 +1,419 @@
+//
+//  event_log.cpp
+//  privavida-core
+//
+
+#include "event_log.hpp"
+#include "../models/hex.hpp"
+#include "../models/verified_ids.hpp"
+#include "../utils/timer.hpp"
+#include <app.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include <vector>
+
+namespace data_layer {
+
+struct SegmentMapping {
+    uint8_t* data;
+    uint32_t len;
+};
+static std::vector<SegmentMapping> mappings;
+
+// Receipts that have changed since the event was written out, which get
+// written back to the log when it's flushed
+struct ReceiptsUpdate {
+    EventLogPosition position;
+    RelDynamicArray<ReceiptInfo> receipt_info;
+    std::vector<ReceiptInfo> receipts;
+};
+static std::vector<ReceiptsUpdate> receipts_updates;
+
+static char log_prefix[32];
+static FILE* append_file = NULL;
+static int append_segment = 0;
+static uint32_t append_segment_size = 0;
+static bool flush_scheduled = false;
+static uint64_t verified_ids_persisted = 0;
+
+static inline uint32_t align_8(uint32_t n) {
+    return n + (8 - n % 8) % 8;
+}
+
+static const char* segment_file_name(int segment) {
+    char file_name[64];
+    snprintf(file_name, sizeof(file_name), "%s_%03d.bin", log_prefix, segment);
+    return app::get_user_data_path(file_name);
+}
+
+static const char* verified_ids_file_name() {
+    char file_name[64];
+    snprintf(file_name, sizeof(file_name), "%s_verified.bin", log_prefix);
+    return app::get_user_data_path(file_name);
+}
+
+static void write_verified_ids(FILE* file, uint32_t start) {
+    VerifiedId entry;
+    for (uint32_t i = start; verified_ids_get(i, &entry); ++i) {
+        fwrite(&entry, sizeof(VerifiedId), 1, file);
+    }
+}
+
+static void load_verified_ids() {
+    auto file_name = verified_ids_file_name();
+
+    uint32_t num_records = 0;
+    FILE* file = fopen(file_name, "rb");
+    if (file) {
+        VerifiedId record;
+        while (fread(&record, sizeof(record), 1, file) == 1) {
+            verified_ids_insert(&record.id, &record.sig);
+            num_records++;
+        }
+        fclose(file);
+    }
+
+    // The file only ever gets appended to, so once it holds a lot more
+    // records than the cache can we rewrite it with what's in the cache
+    if (num_records > VERIFIED_IDS_CAPACITY + VERIFIED_IDS_CAPACITY / 2) {
+        file = fopen(file_name, "wb");
+        if (file) {
+            write_verified_ids(file, 0);
+            fclose(file);
+        }
+    }
+
+    verified_ids_persisted = verified_ids_insert_count();
+}
+
+static void save_verified_ids() {
+    uint64_t insert_count = verified_ids_insert_count();
+    uint64_t num_new = insert_count - verified_ids_persisted;
+    if (num_new == 0) return;
+
+    // If more entries were inserted than the cache holds, we only
+    // write out the ones that haven't been evicted yet
+    uint32_t count = verified_ids_count();
+    uint32_t start = num_new < count ? count - (uint32_t)num_new : 0;
+
+    FILE* file = fopen(verified_ids_file_name(), "ab");
+    if (!file) {
+        printf("Failed to open file: '%s'\n", verified_ids_file_name());
+        return;
+    }
+    write_verified_ids(file, start);
+    fclose(file);
+
+    verified_ids_persisted = insert_count;
+}
+
+static bool is_valid_header(const EventLogSegmentHeader* header) {
+    return (
+        header->magic == EVENT_LOG_MAGIC &&
+        header->version == EVENT_LOG_VERSION &&
+        header->event_version == Event::VERSION
+    );
+}
+
+// Maps a whole segment file into memory (privately, so changes to the
+// mapped events aren't written back). Returns NULL if it can't be.
+static uint8_t* map_segment(const char* file_name, uint32_t* len_out) {
+
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(EventLogSegmentHeader)) {
+        close(fd);
+        return NULL;
+    }
+    auto len = (uint32_t)st.st_size;
+
+    auto data = (uint8_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Failed to map event log segment '%s'\n", file_name);
+        return NULL;
+    }
+
+    *len_out = len;
+    return data;
+}
+
+// Returns the number of bytes of the segment that are valid, or 0 if
+// the segment header itself is invalid
+static uint32_t segment_valid_size(const uint8_t* data, uint32_t len) {
+    if (!is_valid_header((const EventLogSegmentHeader*)data)) {
+        return 0;
+    }
+
+    uint32_t offset = sizeof(EventLogSegmentHeader);
+    while (offset + sizeof(Event) <= len) {
+        auto event = (const Event*)&data[offset];
+        auto size = Event::size_of(event);
+
+        // A partially written event (i.e. we were killed mid-append)
+        // marks the end of the valid part of the segment
+        if (Event::version_number(event) != Event::VERSION ||
+            size < sizeof(Event) || offset + size > len) {
+            break;
+        }
+        offset += align_8(size);
+    }
+
+    return offset < len ? offset : len;
+}
+
+bool event_log_open(const Pubkey* pubkey, EventLogCallback callback) {
+    event_log_close();
+
+    char pubkey_hex[17];
+    hex_encode(pubkey_hex, pubkey->data, 8);
+    pubkey_hex[16] = '\0';
+    snprintf(log_prefix, sizeof(log_prefix), "events_%s", pubkey_hex);
+
+    // Read through each of the segments in order
+    int segment = 0;
+    uint32_t segment_size = 0;
+    while (true) {
+        auto file_name = segment_file_name(segment);
+        struct stat st;
+        if (stat(file_name, &st) != 0) break;
+
+        // A segment we can't map is left alone (we may well be able to
+        // next time), and we append to a new segment after it
+        uint32_t len = 0;
+        auto data = map_segment(file_name, &len);
+        if (!data && st.st_size >= sizeof(EventLogSegmentHeader)) {
+            printf("Event log segment '%s' can't be mapped, skipping it\n", file_name);
+            segment_size = 0;
+            segment++;
+            continue;
+        }
+        uint32_t valid_size = data ? segment_valid_size(data, len) : 0;
+
+        // The segments after an invalid one are removed, otherwise they
+        // would turn up again once we've appended to this one
+        if (valid_size == 0) {
+            printf("Event log segment '%s' is invalid, starting over from here\n", file_name);
+            if (data) {
+                munmap(data, len);
+            }
+            for (int later = segment + 1; stat(segment_file_name(later), &st) == 0; ++later) {
+                remove(segment_file_name(later));
+            }
+            segment_size = 0;
+            break;
+        }
+
+        // The tail is cut off before the segment is mapped for good,
+        // as the file can't be truncated while it's mapped
+        if (valid_size < len) {
+            printf("Event log segment '%s' has a truncated tail (%u of %u bytes valid)\n", file_name, valid_size, len);
+            munmap(data, len);
+            truncate(file_name, valid_size);
+            data = map_segment(file_name, &len);
+            if (!data || len != valid_size) {
+                printf("Event log segment '%s' can't be mapped, skipping it\n", file_name);
+                if (data) {
+                    munmap(data, len);
+                }
+                segment_size = 0;
+                segment++;
+                continue;
+            }
+        }
+
+        SegmentMapping mapping;
+        mapping.data = data;
+        mapping.len = len;
+        mappings.push_back(mapping);
+
+        uint32_t offset = sizeof(EventLogSegmentHeader);
+        while (offset < valid_size) {
+            auto event = (Event*)&data[offset];
+            EventLogPosition position;
+            position.segment = segment;
+            position.offset = offset;
+            callback(event, position);
+            offset += align_8(Event::size_of(event));
+        }
+
+        segment_size = valid_size;
+        segment++;
+    }
+
+    // We continue appending to the last segment we found, unless it was
+    // skipped or there weren't any
+    if (segment > 0 && segment_size > 0) {
+        segment--;
+    }
+    append_segment = segment;
+    append_segment_size = segment_size;
+
+    load_verified_ids();
+    return true;
+}
+
+static bool open_append_file() {
+    auto file_name = segment_file_name(append_segment);
+
+    if (append_segment_size == 0) {
+        append_file = fopen(file_name, "wb");
+        if (!append_file) {
+            printf("Failed to create file: '%s'\n", file_name);
+            return false;
+        }
+
+        EventLogSegmentHeader header;
+        header.magic = EVENT_LOG_MAGIC;
+        header.version = EVENT_LOG_VERSION;
+        header.event_version = Event::VERSION;
+        header.reserved = 0;
+        fwrite(&header, sizeof(header), 1, append_file);
+        append_segment_size = sizeof(header);
+    } else {
+        append_file = fopen(file_name, "ab");
+        if (!append_file) {
+            printf("Failed to open file: '%s'\n", file_name);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Writes the changed receipts back into the segment files. The append
+// file is flushed first, as the events may still be in its buffer.
+static void write_receipts_updates() {
+    if (receipts_updates.empty()) return;
+    if (append_file) {
+        fflush(append_file);
+    }
+
+    int fd = -1;
+    int fd_segment = -1;
+    for (auto& update : receipts_updates) {
+        if (update.position.segment != fd_segment) {
+            if (fd != -1) {
+                close(fd);
+            }
+            fd_segment = update.position.segment;
+            fd = open(segment_file_name(fd_segment), O_WRONLY);
+        }
+        if (fd == -1) continue;
+
+        auto offset = update.position.offset;
+        auto receipts_size = update.receipts.size() * sizeof(ReceiptInfo);
+        if (pwrite(fd, &update.receipt_info, sizeof(update.receipt_info), offset + offsetof(Event, receipt_info)) != sizeof(update.receipt_info) ||
+            pwrite(fd, update.receipts.data(), receipts_size, offset + update.receipt_info.data.offset) != receipts_size) {
+            printf("Failed to update receipts in the event log\n");
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    receipts_updates.clear();
+}
+
+static void flush_later() {
+    // Events tend to arrive in bursts, so we flush once things settle down
+    if (flush_scheduled) return;
+    flush_scheduled = true;
+    timer::set_timeout([]() {
+        flush_scheduled = false;
+        if (log_prefix[0]) {
+            save_verified_ids();
+        }
+        write_receipts_updates();
+        if (append_file) {
+            fflush(append_file);
+        }
+        app::user_data_flush();
+    }, 1000);
+}
+
+EventLogPosition event_log_append(const Event* event) {
+    EventLogPosition position;
+    position.segment = -1;
+    position.offset = 0;
+    if (!log_prefix[0]) return position;
+
+    auto size = Event::size_of(event);
+    auto size_padded = align_8(size);
+
+    // Roll over to a new segment once the current one is full
+    if (append_segment_size > sizeof(EventLogSegmentHeader) &&
+        append_segment_size + size_padded > EVENT_LOG_SEGMENT_SIZE) {
+        if (append_file) {
+            fclose(append_file);
+            append_file = NULL;
+        }
+        append_segment++;
+        append_segment_size = 0;
+    }
+
+    if (!append_file && !open_append_file()) {
+        return position;
+    }
+
+    const uint8_t padding[8] = { 0 };
+    if (fwrite(event, 1, size, append_file) != size ||
+        fwrite(padding, 1, size_padded - size, append_file) != size_padded - size) {
+        printf("Failed to append event to the event log\n");
+        return position;
+    }
+    position.segment = append_segment;
+    position.offset = append_segment_size;
+    append_segment_size += size_padded;
+
+    flush_later();
+    return position;
+}
+
+void event_log_update_receipts(EventLogPosition position, const Event* event) {
+    if (!log_prefix[0] || position.segment == -1) return;
+
+    ReceiptsUpdate update;
+    update.position = position;
+    update.receipt_info = event->receipt_info;
+    auto receipts = event->receipt_info.get(event);
+    update.receipts.assign(receipts.begin(), receipts.end());
+    receipts_updates.push_back(std::move(update));
+
+    flush_later();
+}
+
+void event_log_close() {
+    if (log_prefix[0]) {
+        save_verified_ids();
+        write_receipts_updates();
+    }
+    receipts_updates.clear();
+    verified_ids_clear();
+    verified_ids_persisted = 0;
+    if (append_file) {
+        fclose(append_file);
+        append_file = NULL;
+    }
+    if (log_prefix[0]) {
+        app::user_data_flush();
+    }
+    for (auto& mapping : mappings) {
+        munmap(mapping.data, mapping.len);
+    }
+    mappings.clear();
+    log_prefix[0] = '\0';
+    append_segment = 0;
+    append_segment_size = 0;
+}
+
+}
@@ -0,0 +1,73 @@
+//
+//  event_log.hpp
+//  privavida-core
+//
+
+#pragma once
+#include "../models/event.hpp"
+#include <functional>
+
+// The event log is an append-only, on-disk store of the events we've
+// received. As Event structs only contain relative pointers we simply
+// write the Event blobs out verbatim.
+//
+// The log is split into segment files in the user data directory:
+//
+//     events_<pubkey prefix>_<segment number>.bin
+//
+// Each segment begins with an EventLogSegmentHeader, followed by the
+// Event blobs, each one padded out to an 8-byte boundary (which keeps
+// the mapped Event structs aligned). The size of each blob is read from
+// its Event::__header__.
+//
+// Alongside the segments we keep the verified ids cache (see
+// models/verified_ids.hpp) in events_<pubkey prefix>_verified.bin, as a
+// plain array of VerifiedId records. It's loaded when the log is opened,
+// new entries are appended whenever the log is flushed, and the cache is
+// emptied when the log is closed (on switching accounts).
+
+constexpr uint32_t EVENT_LOG_MAGIC = 0x4c455650; // "PVEL"
+constexpr uint32_t EVENT_LOG_VERSION = 1;
+constexpr uint32_t EVENT_LOG_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+struct EventLogSegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_version;
+    uint32_t reserved;
+};
+
+// Where an event is stored in the log (segment is -1 if it isn't)
+struct EventLogPosition {
+    int32_t segment;
+    uint32_t offset;
+};
+
+namespace data_layer {
+
+typedef std::function<void(Event* event, EventLogPosition position)> EventLogCallback;
+
+// Opens the event log for the given account, calling the callback for
+// every event stored in the log. The segments are memory-mapped
+// (privately, changes to the mapped events aren't written back) and the
+// Event pointers passed to the callback point straight into the mapping,
+// so they stay valid until the log is closed. Also loads the persisted
+// verified ids into the verified ids cache.
+//
+// On the web (emscripten) the files live in memory already, and mapping
+// one makes a copy of it on the heap, so there the mapping only saves
+// us from parsing the events one by one.
+bool event_log_open(const Pubkey* pubkey, EventLogCallback callback);
+EventLogPosition event_log_append(const Event* event);
+
+// Receipts get added to events after they've been written out, these
+// write them back into the log (once it's flushed). The receipts take up
+// the same space in the event's blob, so they're updated in place.
+void event_log_update_receipts(EventLogPosition position, const Event* event);
+
+// Writes out anything still pending (including the verified ids) and
+// unmaps the segments, after which the events handed out by
+// event_log_open() are no longer valid
+void event_log_close();
+
+}
@@ -10,85 +10,533 @@
 #include "accounts.hpp"
 #include "profiles.hpp"
 #include "contact_lists.hpp"
+#include "event_log.hpp"
+#include "event_index.hpp"
 #include "../models/event_content.hpp"
 #include "../models/nip31.hpp"
+#include "../utils/key_table.hpp"
+#include "../utils/worker_pool.hpp"
+#include "../utils/timer.hpp"
 #include <app.hpp>
 #include <vector>
+#include <chrono>
+#include <algorithm>
+#include <stdint.h>
 
 #include "../models/event_stringify.hpp"
 
 namespace data_layer {
 
 std::vector<Event*> events;
+static KeyTable<EventId, EventLocator> events_by_id;
 
-static EventLocator store_event_by_copying(Event* event);
-static EventLocator store_event_without_copying(Event* event);
-static void handle_kind_4(Event* event);
+// Bookkeeping for each of the stored events (indexed by EventLocator)
+struct EventState {
+    bool on_heap; // Otherwise it lives in the event log's mapped segments
+    bool decrypt_queued;
+    bool decrypting;
+    EventLogPosition log_position;
+};
+static std::vector<EventState> event_states;
 
-void receive_event(Event* event, int32_t relay_id, uint64_t receipt_time) {
+// Bumped whenever the store is cleared (i.e. the account is switched),
+// so work that was started before then knows its locators are stale
+static uint32_t store_generation = 0;
+
+// An event that is being verified on the worker pool. Copies of the
+// event that arrive from other relays in the meantime have their
+// receipts recorded here.
+struct PendingEvent {
+    Event* event;
+    Pubkey account_pubkey;
+    std::vector<ReceiptInfo> receipts;
+};
+static KeyTable<EventId, PendingEvent*> events_pending;
+
+// A set of pending events that get verified together. A batch is split
+// into one part per worker, so it's verified by all of them at once.
+struct VerifyJob {
+    std::vector<PendingEvent*> events;
+    bool batched;
+    uint32_t num_parts;
+    uint32_t num_parts_running;
+    std::chrono::steady_clock::time_point start_time;
+};
+
+// During a backfill (i.e. a REQUEST before its EOSE) the events from a
+// relay are collected into a batch, which gets verified once the EOSE
+// arrives, the batch is full, or the batch has been waiting long enough
+constexpr uint32_t BATCH_MAX_EVENTS = 256;
+constexpr long BATCH_MAX_WAIT_MS = 200;
+
+struct EventBatch {
+    int32_t relay_id;
+    int timeout_id;
+    std::vector<PendingEvent*> events;
+};
+static std::vector<EventBatch> batches;
+
+// Direct messages are stored with their content still encrypted, and
+// get decrypted (and tokenized) on the worker pool once they're needed.
+// Messages that are about to be shown go in the first queue, every other
+// one is also in the background queue, which is worked through a batch
+// at a time whenever nothing more urgent is waiting.
+constexpr uint32_t DECRYPT_BATCH_MAX_EVENTS = 64;
+constexpr long DECRYPT_BACKGROUND_INTERVAL_MS = 100;
+
+// The job decrypts heap copies of the events, made on the UI thread, so
+// the workers never touch the stored events (which get their receipts
+// updated in place). Its copy of the account holds the seckey, so that
+// is zeroed along with the job.
+struct DecryptJob {
+    std::vector<EventLocator> event_locs;
+    std::vector<Event*> events;
+    Account account;
+    uint32_t store_generation;
+
+    ~DecryptJob() {
+        secure_zero(&account, sizeof(Account));
+    }
+};
+static std::vector<EventLocator> decrypt_queue;
+static std::vector<EventLocator> decrypt_queue_background;
+static bool decrypt_job_running = false;
+static bool decrypt_background_scheduled = false;
+
+struct VerifyStats {
+    uint64_t num_events;
+    double seconds;
+};
+static VerifyStats verify_stats_single;
+static VerifyStats verify_stats_batched;
+
+static EventLocator store_event(Event* event, bool on_heap, EventLogPosition log_position);
+static bool add_receipt(Event* event, int32_t relay_id, uint64_t receipt_time);
+static void add_stored_receipt(EventLocator event_loc, int32_t relay_id, uint64_t receipt_time);
+static Event* decrypt_kind_4(Event* event, const Account* account);
+static void verify_events(VerifyJob* job);
+static void receive_event_verified(PendingEvent* pending);
+static void handle_event(Event* event, EventLogPosition log_position);
+static void decrypt_events(bool background);
+static void decrypt_events_later();
+
+void receive_event(Event* event, int32_t relay_id, uint64_t receipt_time, bool backfill) {
 
     // Have we already received this event?
-    for (auto& event_other : events) {
-        if (compare_keys(&event_other->id, &event->id)) {
-
-            // Add/update receipt info
-            bool has_receipt = false;
-            for (auto& receipt : event_other->receipt_info.get(event_other)) {
-                if (receipt.relay_id == relay_id) {
-                    if (receipt.receipt_time < receipt_time) {
-                        receipt.receipt_time = receipt_time;
-                    }
-                    has_receipt = true;
-                    break;
-                }
-            }
-            if (!has_receipt && event_other->receipt_info.can_push_back()) {
-                ReceiptInfo receipt;
-                receipt.relay_id = relay_id;
-                receipt.receipt_time = receipt_time;
-                event_other->receipt_info.push_back(event_other, receipt);
-            }
+    auto event_loc_existing = find_event(&event->id);
+    if (event_loc_existing != -1) {
+        add_stored_receipt(event_loc_existing, relay_id, receipt_time);
+        free(event);
+        return;
+    }
+
+    // Are we still busy verifying it?
+    auto pending_existing = events_pending.find(&event->id);
+    if (pending_existing) {
+        ReceiptInfo receipt;
+        receipt.relay_id = relay_id;
+        receipt.receipt_time = receipt_time;
+        (*pending_existing)->receipts.push_back(receipt);
+        free(event);
+        return;
+    }
 
+    switch (event->kind) {
+        case 0:
+        case 3:
+        case 4: break;
+        default: {
+            printf("received event kind %d, which we don't handle current...\n", event->kind);
+            free(event);
             return;
         }
     }
 
-    // Validate the event
-    if (!event_validate(event)) {
-        printf("event invalid: %s\n", event->validity == EVENT_INVALID_ID ? "INVALID_ID" : "INVALID_SIG");
+    auto account = data_layer::current_account();
+    if (!account) {
+        free(event);
+        return;
+    }
+
+    auto pending = new PendingEvent;
+    pending->event = event;
+    pending->account_pubkey = account->pubkey;
+    add_receipt(pending->event, relay_id, receipt_time);
+    events_pending.insert(&event->id, pending);
+
+    // Backfilled events are collected into a batch for their relay,
+    // anything else is verified right away
+    if (!backfill) {
+        auto job = new VerifyJob;
+        job->events.push_back(pending);
+        job->batched = false;
+        verify_events(job);
+        return;
+    }
+
+    EventBatch* batch = NULL;
+    for (auto& other : batches) {
+        if (other.relay_id == relay_id) {
+            batch = &other;
+        }
+    }
+
+    if (!batch) {
+        batches.push_back(EventBatch());
+        batch = &batches.back();
+        batch->relay_id = relay_id;
+        batch->timeout_id = timer::set_timeout([relay_id]() {
+            receive_events_flush(relay_id);
+        }, BATCH_MAX_WAIT_MS);
+    }
+
+    batch->events.push_back(pending);
+    if (batch->events.size() >= BATCH_MAX_EVENTS) {
+        receive_events_flush(relay_id);
+    }
+}
+
+void receive_events_flush(int32_t relay_id) {
+    for (int i = 0; i < batches.size(); ++i) {
+        if (batches[i].relay_id != relay_id) continue;
+
+        timer::clear_timeout(batches[i].timeout_id);
+
+        auto job = new VerifyJob;
+        job->events = std::move(batches[i].events);
+        job->batched = true;
+        batches.erase(batches.begin() + i);
+
+        verify_events(job);
         return;
     }
+}
 
-    // Add receipt info
+// Verifies the events off the UI thread. The time is measured on the
+// wall clock, from handing out the job until its last part is done.
+void verify_events(VerifyJob* job) {
+    uint32_t num_parts = worker_pool::num_workers();
+    uint32_t num_events = (uint32_t)job->events.size();
+    if (num_parts > num_events) {
+        num_parts = num_events;
+    }
+    if (!num_parts) {
+        delete job;
+        return;
+    }
+
+    job->num_parts = num_parts;
+    job->num_parts_running = num_parts;
+    job->start_time = std::chrono::steady_clock::now();
+
+    for (uint32_t part = 0; part < num_parts; ++part) {
+        uint32_t first = num_events * part / num_parts;
+        uint32_t last = num_events * (part + 1) / num_parts;
+
+        worker_pool::run([job, first, last]() {
+            std::vector<Event*> events;
+            for (auto i = first; i < last; ++i) {
+                events.push_back(job->events[i]->event);
+            }
+            event_validate_batch(events.data(), (uint32_t)events.size());
+        }, [job, first, last]() {
+            for (auto i = first; i < last; ++i) {
+                receive_event_verified(job->events[i]);
+            }
+
+            if (--job->num_parts_running) return;
+
+            auto end_time = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(end_time - job->start_time).count();
+            auto& stats = job->batched ? verify_stats_batched : verify_stats_single;
+            stats.num_events += job->events.size();
+            stats.seconds += seconds;
+
+#ifdef PRIVAVIDA_BENCHMARKS
+            if (job->batched) {
+                double single, batched;
+                verify_throughput(&single, &batched);
+                printf("verified batch of %d events in %d parts (%.0f events/s), overall: batched %.0f events/s, single %.0f events/s\n",
+                    (int)job->events.size(), (int)job->num_parts, seconds > 0 ? job->events.size() / seconds : 0.0, batched, single);
+            }
+#endif
+            delete job;
+        });
+    }
+}
+
+void verify_throughput(double* single_out, double* batched_out) {
+    *single_out  = verify_stats_single.seconds  > 0 ? verify_stats_single.num_events  / verify_stats_single.seconds  : 0.0;
+    *batched_out = verify_stats_batched.seconds > 0 ? verify_stats_batched.num_events / verify_stats_batched.seconds : 0.0;
+}
+
+void receive_event_verified(PendingEvent* pending) {
+    auto event = pending->event;
+    events_pending.erase(&event->id);
+
+    // Drop the event if it's invalid, if the account was switched while
+    // we were busy, or if it has been loaded from the event log since
+    auto account = data_layer::current_account();
+    auto event_loc_existing = find_event(&event->id);
+    if (event->validity != EVENT_VALID) {
+        printf("event invalid: %s\n", event->validity == EVENT_INVALID_ID ? "INVALID_ID" : "INVALID_SIG");
+    } else if (!account || !compare_keys(&account->pubkey, &pending->account_pubkey)) {
+        // Nothing to do
+    } else if (event_loc_existing != -1) {
+        for (auto& receipt : pending->receipts) {
+            add_stored_receipt(event_loc_existing, receipt.relay_id, receipt.receipt_time);
+        }
+    } else {
+        for (auto& receipt : pending->receipts) {
+            add_receipt(event, receipt.relay_id, receipt.receipt_time);
+        }
+        auto log_position = event_log_append(event);
+
+        switch (event->kind) {
+            case 0: {
+                auto event_loc = store_event(event, true, log_position);
+                data_layer::receive_profile(event_loc);
+                break;
+            }
+            case 3: {
+                auto event_loc = store_event(event, true, log_position);
+                data_layer::receive_contact_list(event_loc);
+                break;
+            }
+            case 4: {
+                auto event_loc = store_event(event, true, log_position);
+                data_layer::receive_direct_message(event_loc);
+                decrypt_queue_background.push_back(event_loc);
+                decrypt_events_later();
+                break;
+            }
+        }
+        event = NULL;
+    }
+
+    free(event);
+    delete pending;
+}
+
+// Returns whether the receipts changed
+bool add_receipt(Event* event, int32_t relay_id, uint64_t receipt_time) {
+    for (auto& receipt : event->receipt_info.get(event)) {
+        if (receipt.relay_id == relay_id) {
+            if (receipt.receipt_time < receipt_time) {
+                receipt.receipt_time = receipt_time;
+                return true;
+            }
+            return false;
+        }
+    }
     if (event->receipt_info.can_push_back()) {
         ReceiptInfo receipt;
         receipt.relay_id = relay_id;
         receipt.receipt_time = receipt_time;
         event->receipt_info.push_back(event, receipt);
+        return true;
     }
+    return false;
+}
+
+// The receipts of a stored event are also updated in the event log. A
+// decrypted copy keeps its receipts in the same place as the encrypted
+// event in the log, so it can be written back as well.
+void add_stored_receipt(EventLocator event_loc, int32_t relay_id, uint64_t receipt_time) {
+    if (add_receipt(events[event_loc], relay_id, receipt_time)) {
+        event_log_update_receipts(event_states[event_loc].log_position, events[event_loc]);
+    }
+}
+
+// Empties the store (and everything holding on to its locators) and
+// closes the event log, which unmaps the events loaded from it
+static void clear_events() {
+    for (int i = 0; i < events.size(); ++i) {
+        if (event_states[i].on_heap) {
+            free(events[i]);
+        }
+    }
+    events.clear();
+    event_states.clear();
+    events_by_id.clear();
+    event_index_clear();
+    decrypt_queue.clear();
+    decrypt_queue_background.clear();
+    store_generation++;
+
+    data_layer::clear_conversations();
+    event_log_close();
+}
+
+void load_events() {
+    clear_events();
+
+    auto account = data_layer::current_account();
+    if (!account) return;
 
+    // Events in the log have already been validated, so we
+    // can go straight to handling them. The log hands us events
+    // that live in the mapped segments, so we don't copy them.
+    // The id table, the indexes, conversations, contact lists and
+    // profiles aren't persisted though, so they're rebuilt from every
+    // event here, which makes startup linear in the size of the log.
+    auto start_time = std::chrono::steady_clock::now();
+    int num_events = 0;
+    event_log_open(&account->pubkey, [&num_events](Event* event, EventLogPosition log_position) {
+        if (find_event(&event->id) != -1) return;
+        handle_event(event, log_position);
+        num_events++;
+    });
+    auto end_time = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end_time - start_time).count();
+    printf("loaded %d events from the event log in %.1f ms\n", num_events, seconds * 1000.0);
+}
+
+void handle_event(Event* event, EventLogPosition log_position) {
     switch (event->kind) {
         case 0: {
-            auto event_loc = store_event_by_copying(event);
+            auto event_loc = store_event(event, false, log_position);
             data_layer::receive_profile(event_loc);
             break;
         }
         case 3: {
-            auto event_loc = store_event_by_copying(event);
+            auto event_loc = store_event(event, false, log_position);
             data_layer::receive_contact_list(event_loc);
             break;
         }
         case 4: {
-            handle_kind_4(event);
-            break;
-        }
-        default: {
-            printf("received event kind %d, which we don't handle current...\n", event->kind);
+            auto event_loc = store_event(event, false, log_position);
+            data_layer::receive_direct_message(event_loc);
+            decrypt_queue_background.push_back(event_loc);
+            decrypt_events_later();
             break;
         }
     }
 }
 
+bool event_needs_decrypting(const Event* event) {
+    return event->kind == 4 &&
+        event->content_encryption != EVENT_CONTENT_DECRYPTED &&
+        event->content_encryption != EVENT_CONTENT_DECRYPT_FAILED;
+}
+
+void decrypt_event(EventLocator event_loc) {
+    if (event_loc < 0 || event_loc >= events.size()) return;
+
+    auto& state = event_states[event_loc];
+    if (state.decrypt_queued || state.decrypting) return;
+    if (!event_needs_decrypting(events[event_loc])) return;
+
+    state.decrypt_queued = true;
+    decrypt_queue.push_back(event_loc);
+    decrypt_events(false);
+}
+
+// Takes up to a batch's worth of events that still need decrypting off
+// the queue, either in the order they were queued or newest first
+static void take_events_to_decrypt(std::vector<EventLocator>* queue, bool newest_first, DecryptJob* job) {
+    size_t num_taken = 0;
+    while (num_taken < queue->size() && job->event_locs.size() < DECRYPT_BATCH_MAX_EVENTS) {
+        auto event_loc = newest_first ? (*queue)[queue->size() - num_taken - 1] : (*queue)[num_taken];
+        num_taken++;
+
+        auto& state = event_states[event_loc];
+        state.decrypt_queued = false;
+        if (state.decrypting || !event_needs_decrypting(events[event_loc])) continue;
+
+        auto event = events[event_loc];
+        auto event_copy = (Event*)malloc(Event::size_of(event));
+        memcpy(event_copy, event, Event::size_of(event));
+
+        state.decrypting = true;
+        job->event_locs.push_back(event_loc);
+        job->events.push_back(event_copy);
+    }
+
+    if (newest_first) {
+        queue->resize(queue->size() - num_taken);
+    } else {
+        queue->erase(queue->begin(), queue->begin() + num_taken);
+    }
+}
+
+static void decrypt_events_later() {
+    if (decrypt_background_scheduled) return;
+    decrypt_background_scheduled = true;
+    timer::set_timeout([]() {
+        decrypt_background_scheduled = false;
+        decrypt_events(true);
+    }, DECRYPT_BACKGROUND_INTERVAL_MS);
+}
+
+// Runs one decrypt job at a time on the worker pool. The job has its own
+// copy of the account, as it may be switched in the meantime.
+void decrypt_events(bool background) {
+    if (decrypt_job_running) return;
+
+    auto account = data_layer::current_account();
+    if (!account) return;
+
+    auto job = new DecryptJob;
+    job->account = *account;
+    job->store_generation = store_generation;
+    take_events_to_decrypt(&decrypt_queue, false, job);
+    if (background) {
+        take_events_to_decrypt(&decrypt_queue_background, true, job);
+    }
+    if (job->event_locs.empty()) {
+        delete job;
+        return;
+    }
+
+    decrypt_job_running = true;
+    worker_pool::run([job]() {
+        for (auto& event : job->events) {
+            event = decrypt_kind_4(event, &job->account);
+        }
+    }, [job]() {
+        decrypt_job_running = false;
+
+        // Results from before the store was cleared (i.e. for an account
+        // we've since switched away from) are dropped
+        bool stale = job->store_generation != store_generation;
+
+        for (int i = 0; i < job->event_locs.size(); ++i) {
+            auto event_loc = job->event_locs[i];
+            auto event_decrypted = job->events[i];
+            if (stale) {
+                free(event_decrypted);
+                continue;
+            }
+            event_states[event_loc].decrypting = false;
+
+            // Malformed messages (without a p tag) can't be decrypted
+            if (!event_decrypted) continue;
+
+            // Receipts may have been added since the copy was made
+            auto event = events[event_loc];
+            for (auto& receipt : event->receipt_info.get(event)) {
+                add_receipt(event_decrypted, receipt.relay_id, receipt.receipt_time);
+            }
+
+            events[event_loc] = event_decrypted;
+            if (event_states[event_loc].on_heap) {
+                free(event);
+            }
+            event_states[event_loc].on_heap = true;
+
+            data_layer::receive_direct_message_decrypted(event_loc);
+        }
+        delete job;
+
+        if (!decrypt_queue.empty()) {
+            decrypt_events(false);
+        } else if (!decrypt_queue_background.empty()) {
+            decrypt_events_later();
+        }
+    });
+}
+
 const Event* event(EventLocator event_loc) {
     if (event_loc < 0 || event_loc >= events.size()) {
         return NULL;
@@ -96,50 +544,183 @@ const Event* event(EventLocator event_loc) {
     return events[event_loc];
 }
 
-EventLocator store_event_by_copying(Event* event_) {
-    Event* event = (Event*)malloc(Event::size_of(event_));
-    memcpy(event, event_, Event::size_of(event_));
-    EventLocator event_loc = (int)events.size();
-    events.push_back(event);
-    return event_loc;
+EventLocator find_event(const EventId* event_id) {
+    auto event_loc = events_by_id.find(event_id);
+    return event_loc ? *event_loc : -1;
 }
 
-EventLocator store_event_without_copying(Event* event) {
+bool event_is_known(const EventId* event_id) {
+    return events_by_id.contains(event_id) || events_pending.contains(event_id);
+}
+
+// Calls the callback for each stored event within the filters' since and
+// until, newest first, for as long as the callback returns true
+template <typename F>
+static void for_each_in_time_range(const Filters* filters, F callback) {
+    auto range = event_index_range(EVENT_INDEX_CREATED_AT, NULL, 0, filters->since, filters->until);
+    for (auto i = range.size; i > 0; --i) {
+        if (!callback(range[i - 1].event_loc)) break;
+    }
+}
+
+// Collects the index ranges that cover every event the filters could
+// match, picking the index that narrows them down the most. Returns
+// false if none of them do better than a scan of the time range.
+static bool candidate_ranges(const Filters* filters, std::vector<Array<const EventIndexEntry>>* ranges_out) {
+    size_t best_count = event_index_range(EVENT_INDEX_CREATED_AT, NULL, 0, filters->since, filters->until).size;
+    bool found = false;
+    std::vector<Array<const EventIndexEntry>> ranges;
+
+    auto consider = [&](EventIndexType type, const uint8_t* key, uint32_t kind, size_t* count) {
+        auto range = event_index_range(type, key, kind, filters->since, filters->until);
+        ranges.push_back(range);
+        *count += range.size;
+    };
+    auto pick = [&](size_t count) {
+        if (count < best_count) {
+            best_count = count;
+            found = true;
+            ranges_out->swap(ranges);
+        }
+        ranges.clear();
+    };
+
+    if (filters->authors.size) {
+        size_t count = 0;
+        std::vector<uint32_t> author_kinds;
+        for (auto& pubkey : filters->authors.get(filters)) {
+            if (!filters->kinds.size) {
+                event_index_kinds(&pubkey, &author_kinds);
+                for (auto kind : author_kinds) {
+                    consider(EVENT_INDEX_AUTHOR_KIND, pubkey.data, kind, &count);
+                }
+                continue;
+            }
+            for (auto kind : filters->kinds.get(filters)) {
+                consider(EVENT_INDEX_AUTHOR_KIND, pubkey.data, kind, &count);
+            }
+        }
+        pick(count);
+    }
+    if (filters->p_tags.size) {
+        size_t count = 0;
+        for (auto& pubkey : filters->p_tags.get(filters)) {
+            consider(EVENT_INDEX_P_TAG, pubkey.data, 0, &count);
+        }
+        pick(count);
+    }
+    if (filters->e_tags.size) {
+        size_t count = 0;
+        for (auto& event_id : filters->e_tags.get(filters)) {
+            consider(EVENT_INDEX_E_TAG, event_id.data, 0, &count);
+        }
+        pick(count);
+    }
+
+    return found;
+}
+
+static bool created_at_before(EventLocator a, EventLocator b) {
+    if (events[a]->created_at != events[b]->created_at) {
+        return events[a]->created_at < events[b]->created_at;
+    }
+    return a < b;
+}
+
+void query_events(const Filters* filters, std::vector<EventLocator>* results) {
+    results->clear();
+    if (filters->limit == 0) return;
+    size_t limit = filters->limit > 0 ? (size_t)filters->limit : SIZE_MAX;
+
+    // Ids are looked up directly, otherwise we look through whichever
+    // index has the fewest candidates
+    std::vector<Array<const EventIndexEntry>> ranges;
+    if (filters->ids.size) {
+        for (auto& id : filters->ids.get(filters)) {
+            auto event_loc = find_event(&id);
+            if (event_loc != -1 && filters_match(filters, events[event_loc])) {
+                results->push_back(event_loc);
+            }
+        }
+    } else if (candidate_ranges(filters, &ranges)) {
+        for (auto& range : ranges) {
+            for (auto& entry : range) {
+                if (filters_match(filters, events[entry.event_loc])) {
+                    results->push_back(entry.event_loc);
+                }
+            }
+        }
+    } else {
+        for_each_in_time_range(filters, [filters, limit, results](EventLocator event_loc) {
+            if (filters_match(filters, events[event_loc])) {
+                results->push_back(event_loc);
+            }
+            return results->size() < limit;
+        });
+        std::reverse(results->begin(), results->end());
+        return;
+    }
+
+    // The same event can turn up under several keys
+    std::sort(results->begin(), results->end(), &created_at_before);
+    results->erase(std::unique(results->begin(), results->end()), results->end());
+    if (results->size() > limit) {
+        results->erase(results->begin(), results->end() - limit);
+    }
+}
+
+EventLocator find_newest_event(const Pubkey* author, uint32_t kind) {
+    auto range = event_index_range(EVENT_INDEX_AUTHOR_KIND, author->data, kind, -1, -1);
+    return range.size ? range.back().event_loc : -1;
+}
+
+EventLocator store_event(Event* event, bool on_heap, EventLogPosition log_position) {
     EventLocator event_loc = (int)events.size();
     events.push_back(event);
+
+    EventState state;
+    state.on_heap = on_heap;
+    state.decrypt_queued = false;
+    state.decrypting = false;
+    state.log_position = log_position;
+    event_states.push_back(state);
+    event_index_insert(event_loc, event);
+
+    events_by_id.insert(&event->id, event_loc);
     return event_loc;
 }
 
-void handle_kind_4(Event* event) {
-
-    auto account = data_layer::current_account();
+// Decrypts the content of a heap-allocated event (or sets its
+// content_encryption to EVENT_CONTENT_DECRYPT_FAILED), returning the
+// event, which may have been reallocated. Malformed events (without a p
+// tag) are freed, returning NULL. This doesn't touch any of the data
+// layer's state, so it's safe to call from the worker threads.
+Event* decrypt_kind_4(Event* event, const Account* account) {
 
     // Determine counterparty
     Pubkey counterparty;
-    if (!event->p_tags.size) return;
+    if (!event->p_tags.size) {
+        free(event);
+        return NULL;
+    }
     if (compare_keys(&event->p_tags.get(event, 0).pubkey, &account->pubkey)) {
         counterparty = event->pubkey;
     } else {
         counterparty = event->p_tags.get(event, 0).pubkey;
     }
 
-    // Copy the event to the heap
-    Event* event_copy = (Event*)malloc(Event::size_of(event));
-    memcpy(event_copy, event, Event::size_of(event));
-
-    // Decrypt the message
-    event->content_encryption = EVENT_CONTENT_ENCRYPTED;
+    // Decrypt the message (in place, the plaintext is never longer)
+    Event* event_copy = event;
+    event_copy->content_encryption = EVENT_CONTENT_ENCRYPTED;
     auto ciphertext = event->content.data.get(event);
     auto len = event->content.size;
     account_nip04_decrypt(account, &counterparty, ciphertext, len,
-        [event(event_copy), counterparty](bool error, const char* error_reason, const char* plaintext, uint32_t len) {
+        [&event_copy](bool error, const char* error_reason, const char* plaintext, uint32_t len) {
+            auto event = event_copy;
 
             // Get the result
-            const char* result;
             if (error) {
                 event->content_encryption = EVENT_CONTENT_DECRYPT_FAILED;
-                auto event_loc = store_event_without_copying(event);
-                receive_direct_message(event_loc);
                 return;
             }
 
@@ -147,8 +728,6 @@ void handle_kind_4(Event* event) {
             if (len > event->content.size) {
                 printf("NIP04: Decoded plaintext longer than encoded ciphertext!!!\n");
                 event->content_encryption = EVENT_CONTENT_DECRYPT_FAILED;
-                auto event_loc = store_event_without_copying(event);
-                receive_direct_message(event_loc);
                 return;
             }
 
@@ -165,15 +744,13 @@ void handle_kind_4(Event* event) {
             event_content_parse(event, tokens, entities, data);
 
             // Realloc the event to fit the tokenized contents
-            auto event_2 = (Event*)realloc(event, event_content_size_needed_for_copy(event, tokens, entities));
-            event_content_copy_result_into_event(event_2, tokens, entities);
-
-            auto event_loc = store_event_without_copying(event_2);
-            receive_direct_message(event_loc);
+            event_copy = (Event*)realloc(event, event_content_size_needed_for_copy(event, tokens, entities));
+            event_content_copy_result_into_event(event_copy, tokens, entities);
 
         }
     );
 
+    return event_copy;
 }
 
 }
@@ -7,13 +7,48 @@
 
 #pragma once
 #include "../models/event.hpp"
+#include "../models/filters.hpp"
+#include <vector>
 
 typedef int EventLocator;
 
 namespace data_layer {
 
-void receive_event(Event* event, int32_t relay_id, uint64_t receipt_time);
+void load_events();
+
+// Takes ownership of the (heap-allocated) event. Events received while
+// backfilling (i.e. for a REQUEST, before its EOSE) are verified in
+// batches. Call receive_events_flush() once the backfill from a relay
+// is done, to verify any events still waiting in its batch.
+void receive_event(Event* event, int32_t relay_id, uint64_t receipt_time, bool backfill = false);
+void receive_events_flush(int32_t relay_id);
+
+// Gives the throughput (in events/s, going by the wall clock) of
+// verifying events one at a time and of verifying them in backfill
+// batches
+void verify_throughput(double* single_out, double* batched_out);
+
+// Direct messages (kind 4) are stored with their content still
+// encrypted, and get decrypted on the worker pool in the background.
+// Call decrypt_event() for one that's about to be shown, to have it
+// decrypted ahead of the rest. Once it is, the event gets replaced by
+// the decrypted copy (at the same EventLocator), and the conversation
+// it's in is told about it.
+bool event_needs_decrypting(const Event* event);
+void decrypt_event(EventLocator event_loc);
+
 void send_event(Event* event);
 const Event* event(EventLocator event_locator);
+EventLocator find_event(const EventId* event_id); // Returns -1 if not found
+bool event_is_known(const EventId* event_id); // Stored or still being verified
+
+// Runs the filters (following the NIP-01 rules, like a relay would)
+// against the stored events. The matching events are given oldest
+// first, and if the filters have a limit only the newest ones are.
+void query_events(const Filters* filters, std::vector<EventLocator>* results);
+
+// Returns the newest stored event of the kind by the author, or -1 if
+// there isn't one
+EventLocator find_newest_event(const Pubkey* author, uint32_t kind);
 
 }
@@ -11,19 +11,174 @@
 #include "../models/hex.hpp"
 #include "../models/nostr_entity.hpp"
 #include "../models/filters.hpp"
+#include "../utils/key_table.hpp"
+#include "../utils/timer.hpp"
+#include <app.hpp>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <memory>
+#include <algorithm>
 #include <rapidjson/writer.h>
 
 namespace data_layer {
 
-static std::vector<Profile*> profiles;
-static std::vector<Pubkey> profiles_requested;
+// Profiles are cached on disk (in the user data directory), so that
+// they can be shown right away at startup. As Profile structs only
+// contain relative pointers we write the blobs out verbatim:
+//
+//     ProfileCacheHeader
+//     for each profile: uint64_t fetched_at, then the Profile blob
+//                       (padded out to an 8-byte boundary)
+//
+// Cached profiles older than the TTL are refreshed in the background.
+constexpr auto PROFILE_CACHE_FILE = "profiles.bin";
+constexpr uint32_t PROFILE_CACHE_MAGIC = 0x43505650; // "PVPC"
+constexpr uint32_t PROFILE_CACHE_VERSION = 1;
+constexpr long PROFILE_CACHE_SAVE_DELAY_MS = 2000;
+constexpr long PROFILE_REFRESH_DELAY_MS = 2000;
+
+struct ProfileCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t profile_version;
+    uint32_t reserved;
+};
+
+struct StoredProfile {
+    Profile* profile;
+    uint64_t fetched_at; // When we last got (or asked the relays for) it
+};
+
+// Only the newest profile of each author is kept
+static KeyTable<Pubkey, StoredProfile> profiles;
+static KeyTable<Pubkey, bool> profiles_requested; // Until their chunk is done
+static KeyTable<Pubkey, uint64_t> profiles_not_found; // When we last asked
 static bool is_batching = false;
+static uint64_t profile_ttl = 24 * 60 * 60;
+static bool cache_save_scheduled = false;
+
+static inline uint32_t align_8(uint32_t n) {
+    return n + (8 - n % 8) % 8;
+}
+
+static void save_profile_cache() {
+    auto file_name = app::get_user_data_path(PROFILE_CACHE_FILE);
+    FILE* f = fopen(file_name, "wb");
+    if (!f) {
+        printf("Failed to create file: '%s'\n", file_name);
+        return;
+    }
+
+    ProfileCacheHeader header;
+    header.magic = PROFILE_CACHE_MAGIC;
+    header.version = PROFILE_CACHE_VERSION;
+    header.profile_version = Profile::VERSION;
+    header.reserved = 0;
+    fwrite(&header, sizeof(header), 1, f);
+
+    const uint8_t padding[8] = { 0 };
+    profiles.for_each([f, &padding](const Pubkey* pubkey, StoredProfile& stored) {
+        auto size = Profile::size_of(stored.profile);
+        fwrite(&stored.fetched_at, sizeof(uint64_t), 1, f);
+        fwrite(stored.profile, 1, size, f);
+        fwrite(padding, 1, align_8(size) - size, f);
+    });
+
+    fclose(f);
+    app::user_data_flush();
+}
+
+// Profiles tend to arrive in bursts, so we save once things settle down
+static void schedule_save_profile_cache() {
+    if (cache_save_scheduled) return;
+    cache_save_scheduled = true;
+    timer::set_timeout([]() {
+        cache_save_scheduled = false;
+        save_profile_cache();
+    }, PROFILE_CACHE_SAVE_DELAY_MS);
+}
+
+void load_profiles() {
+    static bool did_load = false;
+    if (did_load) return;
+    did_load = true;
+
+    auto file_name = app::get_user_data_path(PROFILE_CACHE_FILE);
+    FILE* f = fopen(file_name, "rb");
+    if (!f) return;
+
+    fseek(f, 0, SEEK_END);
+    auto len = (uint32_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    auto data = (uint8_t*)malloc(len);
+    bool read_ok = len && fread(data, 1, len, f) == len;
+    fclose(f);
+
+    auto header = (const ProfileCacheHeader*)data;
+    if (!read_ok || len < sizeof(ProfileCacheHeader) ||
+        header->magic != PROFILE_CACHE_MAGIC ||
+        header->version != PROFILE_CACHE_VERSION ||
+        header->profile_version != Profile::VERSION) {
+        printf("Profile cache '%s' is invalid, ignoring it\n", file_name);
+        free(data);
+        return;
+    }
+
+    // A partially written record marks the end of the valid part
+    int num_profiles = 0;
+    uint32_t offset = sizeof(ProfileCacheHeader);
+    while (offset + sizeof(uint64_t) + sizeof(Profile) <= len) {
+        uint64_t fetched_at;
+        memcpy(&fetched_at, &data[offset], sizeof(uint64_t));
+        auto cached = (const Profile*)&data[offset + sizeof(uint64_t)];
+        auto size = Profile::size_of(cached);
+        if (Profile::version_number(cached) != Profile::VERSION ||
+            size < sizeof(Profile) || offset + sizeof(uint64_t) + size > len) {
+            break;
+        }
+        offset += sizeof(uint64_t) + align_8(size);
+
+        if (profiles.contains(&cached->pubkey)) continue;
+
+        StoredProfile stored;
+        stored.profile = (Profile*)malloc(size);
+        memcpy(stored.profile, cached, size);
+        stored.fetched_at = fetched_at;
+        profiles.insert(&stored.profile->pubkey, stored);
+        num_profiles++;
+    }
+
+    free(data);
+    printf("loaded %d profiles from the profile cache\n", num_profiles);
+}
+
+void set_profile_ttl(uint64_t ttl_in_seconds) {
+    profile_ttl = ttl_in_seconds;
+}
 
 void receive_profile(EventLocator event_loc) {
     auto event = data_layer::event(event_loc);
 
+    // The event may be one we've stored before, in which case its
+    // receipts tell us when we got it
+    uint64_t fetched_at = 0;
+    for (auto& receipt : event->receipt_info.get(event)) {
+        if (receipt.receipt_time > fetched_at) {
+            fetched_at = receipt.receipt_time;
+        }
+    }
+
+    auto existing = profiles.find(&event->pubkey);
+    if (existing && existing->profile->created_at >= event->created_at) {
+        if (existing->profile->created_at == event->created_at && existing->fetched_at < fetched_at) {
+            existing->fetched_at = fetched_at;
+            schedule_save_profile_cache();
+        }
+        return;
+    }
+
     Profile* profile = (Profile*)malloc(Profile::size_from_event(event));
 
     if (!parse_profile_data(profile, event)) {
@@ -33,59 +188,117 @@ void receive_profile(EventLocator event_loc) {
         return;
     }
 
-    data_layer::profiles.push_back(profile);
+    if (existing) {
+        free(existing->profile);
+        existing->profile = profile;
+        if (existing->fetched_at < fetched_at) {
+            existing->fetched_at = fetched_at;
+        }
+    } else {
+        StoredProfile stored;
+        stored.profile = profile;
+        stored.fetched_at = fetched_at;
+        profiles.insert(&profile->pubkey, stored);
+    }
+    schedule_save_profile_cache();
 
     ui::redraw();
 }
 
 const Profile* get_profile(const Pubkey* pubkey) {
-    for (auto profile : profiles) {
-        if (compare_keys(&profile->pubkey, pubkey)) {
-            return profile;
-        }
-    }
-    return NULL;
+    auto stored = profiles.find(pubkey);
+    return stored ? stored->profile : NULL;
 }
 
+static void refresh_profile(const Pubkey* pubkey);
+
 const Profile* get_or_request_profile(const Pubkey* pubkey) {
-    for (auto profile : profiles) {
-        if (compare_keys(&profile->pubkey, pubkey)) {
-            return profile;
-        }
+    auto stored = profiles.find(pubkey);
+    if (!stored) {
+        request_profile(pubkey);
+        return NULL;
+    }
+
+    if ((uint64_t)time(NULL) > stored->fetched_at + profile_ttl) {
+        refresh_profile(pubkey);
     }
-    request_profile(pubkey);
-    return NULL;
+    return stored->profile;
 }
 
 static std::vector<Pubkey> batched_requests;
+static bool refresh_scheduled = false;
+
+// Profile requests are split up into chunks of authors, and each chunk
+// goes to one of the relays (the best ranked ones first) instead of a
+// single REQ with every author going to all of them. Relays limit how big a REQ can be,
+// and asking all of them for everything mostly gets us duplicates. The
+// chunk size adapts to how quickly the relays answer.
+constexpr uint32_t PROFILE_CHUNK_SIZE_MIN = 20;
+constexpr uint32_t PROFILE_CHUNK_SIZE_MAX = 400;
+constexpr double PROFILE_CHUNK_TARGET_SECONDS = 2.0;
+constexpr long PROFILE_CHUNK_TIMEOUT_MS = 10000; // From when the REQ goes out
+constexpr long PROFILE_CHUNK_QUEUE_TIMEOUT_MS = 30000; // Before the REQ goes out
+constexpr long PROFILE_CHUNK_RETRY_DELAY_MS = 2000;
+
+struct ProfileChunk {
+    std::vector<Pubkey> authors;
+    std::vector<RelayId> relays; // Ranked when the batch was sent
+    uint32_t relay_index; // Into relays
+    uint32_t num_attempts;
+    uint32_t num_relays_asked; // That the REQ went out to
+    network::TaskId task_id;
+    int timeout_id;
+    bool started;
+    bool finished;
+};
+static uint32_t chunk_size = 100;
 
 static void send_batch();
+static void send_chunk(const std::shared_ptr<ProfileChunk>& chunk);
 
 void request_profile(const Pubkey* pubkey) {
-    for (auto& other_pubkey : profiles_requested) {
-        if (compare_keys(&other_pubkey, pubkey)) {
-            return;
-        }
+    if (profiles_requested.contains(pubkey)) {
+        return;
     }
 
-    profiles_requested.push_back(*pubkey);
-
-    bool found = false;
-    for (auto& other_pubkey : batched_requests) {
-        if (compare_keys(&other_pubkey, pubkey)) {
-            found = true;
-            break;
-        }
-    }
-    if (!found) {
-        batched_requests.push_back(*pubkey);
+    // If none of the relays had the profile we don't ask again until
+    // the TTL is up
+    auto asked_at = profiles_not_found.find(pubkey);
+    if (asked_at && (uint64_t)time(NULL) <= *asked_at + profile_ttl) {
+        return;
     }
 
+    // A pubkey stays in profiles_requested until its chunk is done, so
+    // it can't already be in the batch
+    profiles_requested.insert(pubkey, true);
+    batched_requests.push_back(*pubkey);
+
     if (!is_batching) {
         send_batch();
     }
 }
 
+// Stale profiles are still shown, so there's no hurry refreshing them:
+// they're collected up and requested together a little later
+void refresh_profile(const Pubkey* pubkey) {
+    if (profiles_requested.contains(pubkey)) {
+        return;
+    }
+
+    profiles_requested.insert(pubkey, true);
+    batched_requests.push_back(*pubkey);
+
+    if (!refresh_scheduled) {
+        refresh_scheduled = true;
+        timer::set_timeout([]() {
+            refresh_scheduled = false;
+            if (!is_batching) {
+                send_batch();
+            }
+        }, PROFILE_REFRESH_DELAY_MS);
+    }
+}
+
 void batch_profile_requests() {
     is_batching = true;
 }
@@ -95,20 +308,139 @@ void batch_profile_requests_send() {
     send_batch();
 }
 
-void send_batch() {
-    if (batched_requests.empty()) {
-        return;
+// Anyone the relay didn't have a profile for is asked of the next relay,
+// until each of them has been tried. Everyone else is done with, so
+// they can be requested again (once stale). Only if a relay was actually
+// asked do we take it that there's no profile to be found.
+static void retry_chunk(const std::shared_ptr<ProfileChunk>& chunk) {
+    auto retry = std::make_shared<ProfileChunk>();
+    for (auto& pubkey : chunk->authors) {
+        if (!profiles.contains(&pubkey)) {
+            retry->authors.push_back(pubkey);
+        }
+    }
+    retry->relays = chunk->relays;
+    retry->relay_index = (chunk->relay_index + 1) % (uint32_t)chunk->relays.size();
+    retry->num_attempts = chunk->num_attempts + 1;
+    retry->num_relays_asked = chunk->num_relays_asked;
+    bool retrying = !retry->authors.empty() && retry->num_attempts <= chunk->relays.size();
+
+    uint64_t now = time(NULL);
+    for (auto& pubkey : chunk->authors) {
+        bool found = profiles.contains(&pubkey);
+        if (retrying && !found) continue;
+
+        profiles_requested.erase(&pubkey);
+        if (!found && chunk->num_relays_asked) {
+            profiles_not_found.insert(&pubkey, now);
+        }
+    }
+
+    if (retrying) {
+        send_chunk(retry);
+    }
+}
+
+// We aim for chunks that the relays answer within the target time.
+// Only full chunks tell us whether we could go bigger.
+static void adapt_chunk_size(uint32_t num_authors, double seconds) {
+    if (seconds > PROFILE_CHUNK_TARGET_SECONDS) {
+        chunk_size /= 2;
+    } else if (seconds < PROFILE_CHUNK_TARGET_SECONDS / 2 && num_authors >= chunk_size) {
+        chunk_size += chunk_size / 2;
     }
+    chunk_size = std::max(PROFILE_CHUNK_SIZE_MIN, std::min(PROFILE_CHUNK_SIZE_MAX, chunk_size));
+}
 
+void send_chunk(const std::shared_ptr<ProfileChunk>& chunk) {
     StackBufferFixed<256> filters_buffer;
     auto filters = FiltersBuilder(&filters_buffer)
         .kind(0)
-        .authors((uint32_t)batched_requests.size(), &batched_requests[0])
+        .authors((uint32_t)chunk->authors.size(), &chunk->authors[0])
         .finish();
 
-    for (auto relay_id : get_default_relays()) {
-        network::relay_add_task_request(relay_id, filters);
+    // Whichever comes first: the relay is done, or we give up on it (and
+    // cancel the request, so it doesn't keep holding on to one of the
+    // relay's request slots). The relay only gets timed once the REQ has
+    // gone out, as requests can wait a while for a free slot. If it never
+    // goes out (e.g. we can't connect) we move on, but without counting
+    // that against the chunk size.
+    chunk->started = false;
+    chunk->finished = false;
+    chunk->timeout_id = timer::set_timeout([chunk]() {
+        chunk->finished = true;
+        network::relay_cancel_task(chunk->task_id);
+        retry_chunk(chunk);
+    }, PROFILE_CHUNK_QUEUE_TIMEOUT_MS);
+
+    auto start_callback = [chunk]() {
+        if (chunk->finished) return;
+        if (!chunk->started) {
+            chunk->started = true;
+            chunk->num_relays_asked++;
+        }
+        timer::clear_timeout(chunk->timeout_id);
+        chunk->timeout_id = timer::set_timeout([chunk]() {
+            chunk->finished = true;
+            network::relay_cancel_task(chunk->task_id);
+            chunk_size = std::max(PROFILE_CHUNK_SIZE_MIN, chunk_size / 2);
+            retry_chunk(chunk);
+        }, PROFILE_CHUNK_TIMEOUT_MS);
+    };
+
+    chunk->task_id = network::relay_add_task_request(chunk->relays[chunk->relay_index], filters, [chunk](double seconds) {
+        if (chunk->finished) return;
+        chunk->finished = true;
+        timer::clear_timeout(chunk->timeout_id);
+        adapt_chunk_size((uint32_t)chunk->authors.size(), seconds);
+
+        // The events are still being verified at this point
+        timer::set_timeout([chunk]() {
+            retry_chunk(chunk);
+        }, PROFILE_CHUNK_RETRY_DELAY_MS);
+    }, true, start_callback); // The chunk size adapts to its own timing, so it isn't shared
+}
+
+void send_batch() {
+    if (batched_requests.empty()) {
+        return;
+    }
+
+    // Without any relays the requests stay batched until there are
+    auto default_relays = get_default_relays();
+    if (default_relays.size == 0) {
+        return;
+    }
+    std::vector<RelayId> relays(default_relays.begin(), default_relays.end());
+    network::rank_relays(relays.data(), (uint32_t)relays.size());
+
+    // Chunk n goes to the n-th best relay (wrapping around), so a small
+    // batch only goes to the quickest relays. Retries go down the rest.
+    uint32_t num_chunks = 0;
+    for (size_t start = 0; start < batched_requests.size(); start += chunk_size) {
+        size_t end = std::min(batched_requests.size(), start + chunk_size);
+
+        auto chunk = std::make_shared<ProfileChunk>();
+        chunk->authors.assign(batched_requests.begin() + start, batched_requests.begin() + end);
+        chunk->relays = relays;
+        chunk->relay_index = num_chunks % (uint32_t)relays.size();
+        chunk->num_attempts = 1;
+        chunk->num_relays_asked = 0;
+        num_chunks++;
+
+        send_chunk(chunk);
+    }
+
+    // Whatever the relays come back with, these count as fetched
+    // now, so that we don't ask again until they're stale
+    uint64_t now = time(NULL);
+    for (auto& pubkey : batched_requests) {
+        auto stored = profiles.find(&pubkey);
+        if (stored) {
+            stored->fetched_at = now;
+        }
     }
+    schedule_save_profile_cache();
 
     batched_requests.clear();
 }
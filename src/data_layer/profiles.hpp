@@ -11,6 +11,13 @@
 
 namespace data_layer {
 
+// Loads the profiles cached on disk (only does so once)
+void load_profiles();
+
+// Profiles older than this (24 hours by default) are still shown, but
+// get refreshed in the background once they're asked for
+void set_profile_ttl(uint64_t ttl_in_seconds);
+
 void receive_profile(EventLocator event_loc);
 const Profile* get_profile(const Pubkey* pubkey);
 const Profile* get_or_request_profile(const Pubkey* pubkey);
@@ -7,6 +7,8 @@
 
 #include "account.hpp"
 #include "../models/nip04.hpp"
+#include "../models/base64.hpp"
+#include "../models/aes_cbc.hpp"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -161,7 +163,7 @@ void account_nip04_encrypt(const Account* account, const Pubkey* pubkey, const c
         return;
     }
 
-    char ciphertext_out[32 + len * 2];
+    char ciphertext_out[base64_encoded_len(len + AES_BLOCKLEN) + 4 + base64_encoded_len(AES_BLOCKLEN) + 1];
     uint32_t len_out;
 
     Seckey seckey;
@@ -0,0 +1,270 @@
+//
+//  aes_cbc.cpp
+//  privavida-core
+//
+
+#include "aes_cbc.hpp"
+#include "keys.hpp"
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AES_CBC_X86
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_AES) || defined(__ARM_FEATURE_CRYPTO))
+#define AES_CBC_ARMV8
+#include <arm_neon.h>
+#endif
+
+// All the backends use tiny-AES's key expansion. The expanded key is in
+// the standard (FIPS-197) byte order, which is exactly what the AES
+// instructions expect, so the hardware backends can load the round keys
+// straight out of it.
+static constexpr int NUM_ROUNDS = 14;
+static_assert(AES_KEYLEN == 32 && AES_keyExpSize == (NUM_ROUNDS + 1) * 16, "Expecting AES-256");
+
+// The tiny-AES backend
+
+static void aes_cbc_encrypt_c(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CBC_encrypt_buffer(&ctx, buf, len);
+    secure_zero(&ctx, sizeof(ctx));
+}
+
+static void aes_cbc_decrypt_c(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CBC_decrypt_buffer(&ctx, buf, len);
+    secure_zero(&ctx, sizeof(ctx));
+}
+
+#ifdef AES_CBC_X86
+
+// CBC encryption is inherently serial (each block is chained on the
+// previous ciphertext), but decryption isn't, so we run 4 blocks through
+// the pipeline at a time.
+
+__attribute__((target("aes,sse2")))
+static void aes_cbc_encrypt_aesni(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, key);
+    __m128i round_keys[NUM_ROUNDS + 1];
+    for (int i = 0; i <= NUM_ROUNDS; ++i) {
+        round_keys[i] = _mm_loadu_si128((const __m128i*)&ctx.RoundKey[16 * i]);
+    }
+
+    __m128i chain = _mm_loadu_si128((const __m128i*)iv);
+    for (size_t offset = 0; offset + AES_BLOCKLEN <= len; offset += AES_BLOCKLEN) {
+        __m128i block = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&buf[offset]), chain);
+        block = _mm_xor_si128(block, round_keys[0]);
+        for (int i = 1; i < NUM_ROUNDS; ++i) {
+            block = _mm_aesenc_si128(block, round_keys[i]);
+        }
+        chain = _mm_aesenclast_si128(block, round_keys[NUM_ROUNDS]);
+        _mm_storeu_si128((__m128i*)&buf[offset], chain);
+    }
+
+    secure_zero(&ctx, sizeof(ctx));
+    secure_zero(round_keys, sizeof(round_keys));
+}
+
+__attribute__((target("aes,sse2")))
+static void aes_cbc_decrypt_aesni(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, key);
+
+    // The equivalent inverse cipher uses the round keys in reverse, with
+    // InvMixColumns applied to all but the first and last
+    __m128i round_keys[NUM_ROUNDS + 1];
+    round_keys[0] = _mm_loadu_si128((const __m128i*)&ctx.RoundKey[16 * NUM_ROUNDS]);
+    for (int i = 1; i < NUM_ROUNDS; ++i) {
+        round_keys[i] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)&ctx.RoundKey[16 * (NUM_ROUNDS - i)]));
+    }
+    round_keys[NUM_ROUNDS] = _mm_loadu_si128((const __m128i*)&ctx.RoundKey[0]);
+
+    __m128i chain = _mm_loadu_si128((const __m128i*)iv);
+    size_t offset = 0;
+
+    for (; offset + 4 * AES_BLOCKLEN <= len; offset += 4 * AES_BLOCKLEN) {
+        __m128i in_0 = _mm_loadu_si128((const __m128i*)&buf[offset]);
+        __m128i in_1 = _mm_loadu_si128((const __m128i*)&buf[offset + 16]);
+        __m128i in_2 = _mm_loadu_si128((const __m128i*)&buf[offset + 32]);
+        __m128i in_3 = _mm_loadu_si128((const __m128i*)&buf[offset + 48]);
+
+        __m128i b_0 = _mm_xor_si128(in_0, round_keys[0]);
+        __m128i b_1 = _mm_xor_si128(in_1, round_keys[0]);
+        __m128i b_2 = _mm_xor_si128(in_2, round_keys[0]);
+        __m128i b_3 = _mm_xor_si128(in_3, round_keys[0]);
+        for (int i = 1; i < NUM_ROUNDS; ++i) {
+            b_0 = _mm_aesdec_si128(b_0, round_keys[i]);
+            b_1 = _mm_aesdec_si128(b_1, round_keys[i]);
+            b_2 = _mm_aesdec_si128(b_2, round_keys[i]);
+            b_3 = _mm_aesdec_si128(b_3, round_keys[i]);
+        }
+        b_0 = _mm_aesdeclast_si128(b_0, round_keys[NUM_ROUNDS]);
+        b_1 = _mm_aesdeclast_si128(b_1, round_keys[NUM_ROUNDS]);
+        b_2 = _mm_aesdeclast_si128(b_2, round_keys[NUM_ROUNDS]);
+        b_3 = _mm_aesdeclast_si128(b_3, round_keys[NUM_ROUNDS]);
+
+        _mm_storeu_si128((__m128i*)&buf[offset],      _mm_xor_si128(b_0, chain));
+        _mm_storeu_si128((__m128i*)&buf[offset + 16], _mm_xor_si128(b_1, in_0));
+        _mm_storeu_si128((__m128i*)&buf[offset + 32], _mm_xor_si128(b_2, in_1));
+        _mm_storeu_si128((__m128i*)&buf[offset + 48], _mm_xor_si128(b_3, in_2));
+        chain = in_3;
+    }
+
+    for (; offset + AES_BLOCKLEN <= len; offset += AES_BLOCKLEN) {
+        __m128i in = _mm_loadu_si128((const __m128i*)&buf[offset]);
+        __m128i block = _mm_xor_si128(in, round_keys[0]);
+        for (int i = 1; i < NUM_ROUNDS; ++i) {
+            block = _mm_aesdec_si128(block, round_keys[i]);
+        }
+        block = _mm_aesdeclast_si128(block, round_keys[NUM_ROUNDS]);
+        _mm_storeu_si128((__m128i*)&buf[offset], _mm_xor_si128(block, chain));
+        chain = in;
+    }
+
+    secure_zero(&ctx, sizeof(ctx));
+    secure_zero(round_keys, sizeof(round_keys));
+}
+
+static bool has_aesni() {
+    return __builtin_cpu_supports("aes");
+}
+
+#endif
+
+#ifdef AES_CBC_ARMV8
+
+// AESE/AESD do AddRoundKey first (unlike AES-NI, which does it last), so
+// the final round key gets XORed in separately
+
+static void aes_cbc_encrypt_armv8(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, key);
+    uint8x16_t round_keys[NUM_ROUNDS + 1];
+    for (int i = 0; i <= NUM_ROUNDS; ++i) {
+        round_keys[i] = vld1q_u8(&ctx.RoundKey[16 * i]);
+    }
+
+    uint8x16_t chain = vld1q_u8(iv);
+    for (size_t offset = 0; offset + AES_BLOCKLEN <= len; offset += AES_BLOCKLEN) {
+        uint8x16_t block = veorq_u8(vld1q_u8(&buf[offset]), chain);
+        for (int i = 0; i < NUM_ROUNDS - 1; ++i) {
+            block = vaesmcq_u8(vaeseq_u8(block, round_keys[i]));
+        }
+        block = vaeseq_u8(block, round_keys[NUM_ROUNDS - 1]);
+        chain = veorq_u8(block, round_keys[NUM_ROUNDS]);
+        vst1q_u8(&buf[offset], chain);
+    }
+
+    secure_zero(&ctx, sizeof(ctx));
+    secure_zero(round_keys, sizeof(round_keys));
+}
+
+static void aes_cbc_decrypt_armv8(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len) {
+    AES_ctx ctx;
+    AES_init_ctx(&ctx, key);
+
+    uint8x16_t round_keys[NUM_ROUNDS + 1];
+    round_keys[0] = vld1q_u8(&ctx.RoundKey[16 * NUM_ROUNDS]);
+    for (int i = 1; i < NUM_ROUNDS; ++i) {
+        round_keys[i] = vaesimcq_u8(vld1q_u8(&ctx.RoundKey[16 * (NUM_ROUNDS - i)]));
+    }
+    round_keys[NUM_ROUNDS] = vld1q_u8(&ctx.RoundKey[0]);
+
+    uint8x16_t chain = vld1q_u8(iv);
+    size_t offset = 0;
+
+    for (; offset + 4 * AES_BLOCKLEN <= len; offset += 4 * AES_BLOCKLEN) {
+        uint8x16_t in_0 = vld1q_u8(&buf[offset]);
+        uint8x16_t in_1 = vld1q_u8(&buf[offset + 16]);
+        uint8x16_t in_2 = vld1q_u8(&buf[offset + 32]);
+        uint8x16_t in_3 = vld1q_u8(&buf[offset + 48]);
+
+        uint8x16_t b_0 = in_0, b_1 = in_1, b_2 = in_2, b_3 = in_3;
+        for (int i = 0; i < NUM_ROUNDS - 1; ++i) {
+            b_0 = vaesimcq_u8(vaesdq_u8(b_0, round_keys[i]));
+            b_1 = vaesimcq_u8(vaesdq_u8(b_1, round_keys[i]));
+            b_2 = vaesimcq_u8(vaesdq_u8(b_2, round_keys[i]));
+            b_3 = vaesimcq_u8(vaesdq_u8(b_3, round_keys[i]));
+        }
+        b_0 = veorq_u8(vaesdq_u8(b_0, round_keys[NUM_ROUNDS - 1]), round_keys[NUM_ROUNDS]);
+        b_1 = veorq_u8(vaesdq_u8(b_1, round_keys[NUM_ROUNDS - 1]), round_keys[NUM_ROUNDS]);
+        b_2 = veorq_u8(vaesdq_u8(b_2, round_keys[NUM_ROUNDS - 1]), round_keys[NUM_ROUNDS]);
+        b_3 = veorq_u8(vaesdq_u8(b_3, round_keys[NUM_ROUNDS - 1]), round_keys[NUM_ROUNDS]);
+
+        vst1q_u8(&buf[offset],      veorq_u8(b_0, chain));
+        vst1q_u8(&buf[offset + 16], veorq_u8(b_1, in_0));
+        vst1q_u8(&buf[offset + 32], veorq_u8(b_2, in_1));
+        vst1q_u8(&buf[offset + 48], veorq_u8(b_3, in_2));
+        chain = in_3;
+    }
+
+    for (; offset + AES_BLOCKLEN <= len; offset += AES_BLOCKLEN) {
+        uint8x16_t in = vld1q_u8(&buf[offset]);
+        uint8x16_t block = in;
+        for (int i = 0; i < NUM_ROUNDS - 1; ++i) {
+            block = vaesimcq_u8(vaesdq_u8(block, round_keys[i]));
+        }
+        block = veorq_u8(vaesdq_u8(block, round_keys[NUM_ROUNDS - 1]), round_keys[NUM_ROUNDS]);
+        vst1q_u8(&buf[offset], veorq_u8(block, chain));
+        chain = in;
+    }
+
+    secure_zero(&ctx, sizeof(ctx));
+    secure_zero(round_keys, sizeof(round_keys));
+}
+
+static bool has_armv8_aes() {
+    return true; // Compiled in means the target has it
+}
+
+#endif
+
+static bool has_c() {
+    return true;
+}
+
+struct AesCbcBackend {
+    const char* name;
+    bool (*supported)();
+    void (*encrypt)(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len);
+    void (*decrypt)(const uint8_t* key, const uint8_t* iv, uint8_t* buf, size_t len);
+};
+
+// In order of preference, the first supported one gets used
+static const AesCbcBackend backends[] = {
+#ifdef AES_CBC_X86
+    { "aes-ni",   has_aesni,     aes_cbc_encrypt_aesni, aes_cbc_decrypt_aesni },
+#endif
+#ifdef AES_CBC_ARMV8
+    { "armv8",    has_armv8_aes, aes_cbc_encrypt_armv8, aes_cbc_decrypt_armv8 },
+#endif
+    { "tiny-aes", has_c,         aes_cbc_encrypt_c,     aes_cbc_decrypt_c },
+};
+
+static const AesCbcBackend* select_backend() {
+    for (auto& backend : backends) {
+        if (backend.supported()) return &backend;
+    }
+    return NULL;
+}
+
+static const AesCbcBackend* get_backend() {
+    static const AesCbcBackend* backend = select_backend();
+    return backend;
+}
+
+void aes_cbc_encrypt(const uint8_t key[AES_KEYLEN], const uint8_t iv[AES_BLOCKLEN], uint8_t* buf, size_t len) {
+    get_backend()->encrypt(key, iv, buf, len);
+}
+
+void aes_cbc_decrypt(const uint8_t key[AES_KEYLEN], const uint8_t iv[AES_BLOCKLEN], uint8_t* buf, size_t len) {
+    get_backend()->decrypt(key, iv, buf, len);
+}
+
+const char* aes_cbc_backend_name() {
+    return get_backend()->name;
+}
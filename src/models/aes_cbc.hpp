@@ -0,0 +1,26 @@
+//
+//  aes_cbc.hpp
+//  privavida-core
+//
+
+#pragma once
+#include <inttypes.h>
+#include <stddef.h>
+
+extern "C" {
+#include "c/aes.h"
+}
+
+// AES-256-CBC (as used by NIP-04), with the key expansion and block
+// cipher done by the fastest backend the CPU supports (picked at
+// runtime): AES-NI on x86, the ARMv8 crypto extensions on arm64, and
+// tiny-AES (c/aes.c) everywhere else.
+//
+// The buffer is encrypted/decrypted in place and its length must be a
+// multiple of AES_BLOCKLEN. Any key material is zeroed before returning.
+
+void aes_cbc_encrypt(const uint8_t key[AES_KEYLEN], const uint8_t iv[AES_BLOCKLEN], uint8_t* buf, size_t len);
+void aes_cbc_decrypt(const uint8_t key[AES_KEYLEN], const uint8_t iv[AES_BLOCKLEN], uint8_t* buf, size_t len);
+
+// The name of the backend in use, e.g. "aes-ni"
+const char* aes_cbc_backend_name();
@@ -0,0 +1,436 @@
+//
+//  base64.cpp
+//  privavida-core
+//
+
+#include "base64.hpp"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BASE64_X86
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#define BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+static const char base64_lookup[64] = {
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
+    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
+    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
+    'w', 'x', 'y', 'z', '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
+};
+
+static const int8_t base64_lookup_rev[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+// Each of the vectorized versions works through as many whole vectors
+// as it can and then leaves the rest to the scalar version. They always
+// leave it the last few characters, which is where any padding is.
+
+static int base64_decode_scalar(uint8_t* output, const char* input, int input_len) {
+    auto in = (const uint8_t*)input;
+
+    // Strip the padding (if there is any)
+    if (input_len >= 4 && input_len % 4 == 0 && in[input_len - 1] == '=') {
+        input_len--;
+        if (in[input_len - 1] == '=') input_len--;
+    }
+    if (input_len % 4 == 1) return -1;
+
+    uint8_t* out = output;
+    int i = 0;
+    for (; i + 4 <= input_len; i += 4) {
+        int a = base64_lookup_rev[in[i]];
+        int b = base64_lookup_rev[in[i + 1]];
+        int c = base64_lookup_rev[in[i + 2]];
+        int d = base64_lookup_rev[in[i + 3]];
+        if ((a | b | c | d) < 0) return -1;
+
+        uint32_t triple = (a << 18) | (b << 12) | (c << 6) | d;
+        *out++ = (uint8_t)(triple >> 16);
+        *out++ = (uint8_t)(triple >> 8);
+        *out++ = (uint8_t)triple;
+    }
+
+    if (i < input_len) {
+        int a = base64_lookup_rev[in[i]];
+        int b = base64_lookup_rev[in[i + 1]];
+        int c = (i + 2 < input_len) ? base64_lookup_rev[in[i + 2]] : 0;
+        if ((a | b | c) < 0) return -1;
+
+        *out++ = (uint8_t)((a << 2) | (b >> 4));
+        if (i + 2 < input_len) {
+            *out++ = (uint8_t)((b << 4) | (c >> 2));
+        }
+    }
+
+    return (int)(out - output);
+}
+
+static int base64_encode_scalar(char* output, const uint8_t* input, int input_len) {
+    char* out = output;
+    int i = 0;
+    for (; i + 3 <= input_len; i += 3) {
+        uint32_t triple = (input[i] << 16) | (input[i + 1] << 8) | input[i + 2];
+        *out++ = base64_lookup[(triple >> 18) & 0x3F];
+        *out++ = base64_lookup[(triple >> 12) & 0x3F];
+        *out++ = base64_lookup[(triple >> 6) & 0x3F];
+        *out++ = base64_lookup[triple & 0x3F];
+    }
+
+    if (i < input_len) {
+        uint32_t triple = (input[i] << 16) | ((i + 1 < input_len) ? (input[i + 1] << 8) : 0);
+        *out++ = base64_lookup[(triple >> 18) & 0x3F];
+        *out++ = base64_lookup[(triple >> 12) & 0x3F];
+        *out++ = (i + 1 < input_len) ? base64_lookup[(triple >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+
+    return (int)(out - output);
+}
+
+static inline int decode_tail(uint8_t* output, uint8_t* out, const char* input, int input_len) {
+    int len = base64_decode_scalar(out, input, input_len);
+    return len < 0 ? -1 : (int)(out - output) + len;
+}
+
+#ifdef BASE64_X86
+
+// The SSSE3/AVX2 versions follow Muła & Lemire, "Faster Base64 Encoding
+// and Decoding Using AVX2 Instructions" (2018): the character class of
+// each byte is looked up by its low and high nibble, and the classes
+// tell us both whether it's valid and what to add to it to get its value.
+
+// SSSE3: 16 characters -> 12 bytes per iteration
+__attribute__((target("ssse3")))
+static int base64_decode_ssse3(uint8_t* output, const char* input, int input_len) {
+    const __m128i lut_lo   = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi   = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f  = _mm_set1_epi8(0x2F);
+    const __m128i pack     = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    uint8_t* out = output;
+
+    // Stopping 8 characters early means the 16-byte stores (only 12 of
+    // which are output) never write past the end of the output
+    for (; input_len >= 24; input_len -= 16, input += 16, out += 12) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)input);
+
+        __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(chars, 4), mask_2f);
+        __m128i lo_nibbles = _mm_and_si128(chars, mask_2f);
+        __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        if (_mm_movemask_epi8(invalid) != 0xFFFF) return -1;
+
+        __m128i eq_2f = _mm_cmpeq_epi8(chars, mask_2f);
+        __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+        __m128i values = _mm_add_epi8(chars, roll);
+
+        // Merge the 6-bit values into 24-bit groups, then pack them
+        __m128i merged = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+        merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(merged, pack));
+    }
+
+    return decode_tail(output, out, input, input_len);
+}
+
+// SSSE3: 12 bytes -> 16 characters per iteration
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(char* output, const uint8_t* input, int input_len) {
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i shift_lut = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+    );
+
+    char* out = output;
+
+    // The loads are 16 bytes, of which we use 12
+    for (; input_len >= 16; input_len -= 12, input += 12, out += 16) {
+        __m128i bytes = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)input), shuffle);
+
+        // Split each 24-bit group into four 6-bit indices
+        __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(bytes, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        __m128i t1 = _mm_mullo_epi16(_mm_and_si128(bytes, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(t0, t1);
+
+        // Work out which range each index is in, and offset it into ASCII
+        __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+        range = _mm_or_si128(range, _mm_and_si128(less, _mm_set1_epi8(13)));
+        __m128i chars = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, range), indices);
+        _mm_storeu_si128((__m128i*)out, chars);
+    }
+
+    return (int)(out - output) + base64_encode_scalar(out, input, input_len);
+}
+
+// AVX2: 32 characters -> 24 bytes per iteration
+__attribute__((target("avx2")))
+static int base64_decode_avx2(uint8_t* output, const char* input, int input_len) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+    );
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+    );
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+    );
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+    const __m256i pack = _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+    );
+    const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+    uint8_t* out = output;
+
+    // Stopping 16 characters early means the 32-byte stores (only 24 of
+    // which are output) never write past the end of the output
+    for (; input_len >= 48; input_len -= 32, input += 32, out += 24) {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)input);
+
+        __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(chars, 4), mask_2f);
+        __m256i lo_nibbles = _mm256_and_si256(chars, mask_2f);
+        __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) return -1;
+
+        __m256i eq_2f = _mm256_cmpeq_epi8(chars, mask_2f);
+        __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+        __m256i values = _mm256_add_epi8(chars, roll);
+
+        __m256i merged = _mm256_maddubs_epi16(values, _mm256_set1_epi32(0x01400140));
+        merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        merged = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(merged, pack), pack_lanes);
+        _mm256_storeu_si256((__m256i*)out, merged);
+    }
+
+    return decode_tail(output, out, input, input_len);
+}
+
+static bool has_ssse3() {
+    return __builtin_cpu_supports("ssse3");
+}
+
+static bool has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef BASE64_NEON
+
+static inline uint8x16_t neon_decode_chars(uint8x16_t chars, uint8x16_t* invalid) {
+    uint8x16_t upper = vcltq_u8(vsubq_u8(chars, vdupq_n_u8('A')), vdupq_n_u8(26));
+    uint8x16_t lower = vcltq_u8(vsubq_u8(chars, vdupq_n_u8('a')), vdupq_n_u8(26));
+    uint8x16_t digit = vcltq_u8(vsubq_u8(chars, vdupq_n_u8('0')), vdupq_n_u8(10));
+    uint8x16_t plus  = vceqq_u8(chars, vdupq_n_u8('+'));
+    uint8x16_t slash = vceqq_u8(chars, vdupq_n_u8('/'));
+
+    uint8x16_t offset = vandq_u8(upper, vdupq_n_u8((uint8_t)(0 - 'A')));
+    offset = vorrq_u8(offset, vandq_u8(lower, vdupq_n_u8((uint8_t)(26 - 'a'))));
+    offset = vorrq_u8(offset, vandq_u8(digit, vdupq_n_u8((uint8_t)(52 - '0'))));
+    offset = vorrq_u8(offset, vandq_u8(plus,  vdupq_n_u8((uint8_t)(62 - '+'))));
+    offset = vorrq_u8(offset, vandq_u8(slash, vdupq_n_u8((uint8_t)(63 - '/'))));
+
+    uint8x16_t valid = vorrq_u8(vorrq_u8(upper, lower), vorrq_u8(digit, vorrq_u8(plus, slash)));
+    *invalid = vorrq_u8(*invalid, vmvnq_u8(valid));
+    return vaddq_u8(chars, offset);
+}
+
+// NEON: 64 characters -> 48 bytes per iteration. vld4q/vst3q do the
+// (de)interleaving into the 4 characters/3 bytes of each group for us.
+static int base64_decode_neon(uint8_t* output, const char* input, int input_len) {
+    uint8_t* out = output;
+
+    for (; input_len >= 68; input_len -= 64, input += 64, out += 48) {
+        uint8x16x4_t chars = vld4q_u8((const uint8_t*)input);
+        uint8x16_t invalid = vdupq_n_u8(0);
+        uint8x16_t a = neon_decode_chars(chars.val[0], &invalid);
+        uint8x16_t b = neon_decode_chars(chars.val[1], &invalid);
+        uint8x16_t c = neon_decode_chars(chars.val[2], &invalid);
+        uint8x16_t d = neon_decode_chars(chars.val[3], &invalid);
+        if (vmaxvq_u8(invalid) != 0) return -1;
+
+        uint8x16x3_t bytes;
+        bytes.val[0] = vorrq_u8(vshlq_n_u8(a, 2), vshrq_n_u8(b, 4));
+        bytes.val[1] = vorrq_u8(vshlq_n_u8(b, 4), vshrq_n_u8(c, 2));
+        bytes.val[2] = vorrq_u8(vshlq_n_u8(c, 6), d);
+        vst3q_u8(out, bytes);
+    }
+
+    return decode_tail(output, out, input, input_len);
+}
+
+// NEON: 48 bytes -> 64 characters per iteration
+static int base64_encode_neon(char* output, const uint8_t* input, int input_len) {
+    uint8x16x4_t lookup;
+    lookup.val[0] = vld1q_u8((const uint8_t*)&base64_lookup[0]);
+    lookup.val[1] = vld1q_u8((const uint8_t*)&base64_lookup[16]);
+    lookup.val[2] = vld1q_u8((const uint8_t*)&base64_lookup[32]);
+    lookup.val[3] = vld1q_u8((const uint8_t*)&base64_lookup[48]);
+    const uint8x16_t mask = vdupq_n_u8(0x3F);
+
+    char* out = output;
+
+    for (; input_len >= 48; input_len -= 48, input += 48, out += 64) {
+        uint8x16x3_t bytes = vld3q_u8(input);
+        uint8x16x4_t chars;
+        chars.val[0] = vshrq_n_u8(bytes.val[0], 2);
+        chars.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[0], 4), vshrq_n_u8(bytes.val[1], 4)), mask);
+        chars.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(bytes.val[1], 2), vshrq_n_u8(bytes.val[2], 6)), mask);
+        chars.val[3] = vandq_u8(bytes.val[2], mask);
+        chars.val[0] = vqtbl4q_u8(lookup, chars.val[0]);
+        chars.val[1] = vqtbl4q_u8(lookup, chars.val[1]);
+        chars.val[2] = vqtbl4q_u8(lookup, chars.val[2]);
+        chars.val[3] = vqtbl4q_u8(lookup, chars.val[3]);
+        vst4q_u8((uint8_t*)out, chars);
+    }
+
+    return (int)(out - output) + base64_encode_scalar(out, input, input_len);
+}
+
+static bool has_neon() {
+    return true; // Always there on arm64
+}
+
+#endif
+
+static bool has_scalar() {
+    return true;
+}
+
+struct Base64Impl {
+    const char* name;
+    bool (*supported)();
+    int (*decode)(uint8_t* output, const char* input, int input_len);
+    int (*encode)(char* output, const uint8_t* input, int input_len);
+};
+
+// In order of preference, the first supported one gets used
+static const Base64Impl base64_impls[] = {
+#ifdef BASE64_X86
+    { "avx2",   has_avx2,   base64_decode_avx2,   base64_encode_ssse3 },
+    { "ssse3",  has_ssse3,  base64_decode_ssse3,  base64_encode_ssse3 },
+#endif
+#ifdef BASE64_NEON
+    { "neon",   has_neon,   base64_decode_neon,   base64_encode_neon },
+#endif
+    { "scalar", has_scalar, base64_decode_scalar, base64_encode_scalar },
+};
+
+static const Base64Impl* select_impl() {
+    for (auto& impl : base64_impls) {
+        if (impl.supported()) return &impl;
+    }
+    return NULL;
+}
+
+static const Base64Impl* get_impl() {
+    static const Base64Impl* impl = select_impl();
+    return impl;
+}
+
+int base64_decode(uint8_t* output, const char* input, int input_len) {
+    return get_impl()->decode(output, input, input_len);
+}
+
+int base64_encode(char* output, const uint8_t* input, int input_len) {
+    return get_impl()->encode(output, input, input_len);
+}
+
+#ifdef PRIVAVIDA_BENCHMARKS
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+void base64_benchmark() {
+
+    // A short DM, and a long one (e.g. a pasted log)
+    const int SIZES[] = { 48, 65536 };
+    const int TOTAL_BYTES = 64 * 1024 * 1024;
+    const int MAX_SIZE = 65536;
+
+    static uint8_t bytes[MAX_SIZE], bytes_decoded[MAX_SIZE];
+    static char chars[MAX_SIZE * 4 / 3 + 4], chars_expected[MAX_SIZE * 4 / 3 + 4];
+    for (int i = 0; i < MAX_SIZE; ++i) {
+        bytes[i] = (uint8_t)(i * 167 + 13);
+    }
+
+    for (auto& impl : base64_impls) {
+        if (!impl.supported()) continue;
+
+        // Check it against the scalar version first, for every length
+        // up to a few vectors, with and without padding, and with an
+        // invalid character at every position
+        bool ok = true;
+        for (int len = 0; ok && len < 200; ++len) {
+            int chars_len = base64_encode_scalar(chars_expected, bytes, len);
+            ok = impl.encode(chars, bytes, len) == chars_len && memcmp(chars, chars_expected, chars_len) == 0;
+            ok = ok && impl.decode(bytes_decoded, chars, chars_len) == len && memcmp(bytes, bytes_decoded, len) == 0;
+
+            while (chars_len > 0 && chars[chars_len - 1] == '=') chars_len--;
+            ok = ok && impl.decode(bytes_decoded, chars, chars_len) == len && memcmp(bytes, bytes_decoded, len) == 0;
+
+            for (int i = 0; ok && i < chars_len; ++i) {
+                char ch = chars[i];
+                chars[i] = (i % 3 == 0 && i + 2 < chars_len) ? '=' : (i % 3 == 1) ? '?' : (char)0x80;
+                ok = impl.decode(bytes_decoded, chars, chars_len) == -1;
+                chars[i] = ch;
+            }
+        }
+        if (!ok) {
+            printf("base64 %s: FAILED\n", impl.name);
+            continue;
+        }
+
+        for (int size : SIZES) {
+            int iterations = TOTAL_BYTES / size;
+            int chars_len = base64_encode_scalar(chars_expected, bytes, size);
+
+            auto start_time = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                impl.encode(chars, bytes, size);
+                __asm__ __volatile__("" : : "r"(chars) : "memory");
+            }
+            auto mid_time = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                impl.decode(bytes_decoded, chars_expected, chars_len);
+                __asm__ __volatile__("" : : "r"(bytes_decoded) : "memory");
+            }
+            auto end_time = std::chrono::steady_clock::now();
+
+            double total_mb = (double)size * iterations / (1024 * 1024);
+            double encode_seconds = std::chrono::duration<double>(mid_time - start_time).count();
+            double decode_seconds = std::chrono::duration<double>(end_time - mid_time).count();
+            printf("base64 %s (%d bytes): encode %.0f MB/s, decode %.0f MB/s\n",
+                   impl.name, size, total_mb / encode_seconds, total_mb / decode_seconds);
+        }
+    }
+}
+#endif
@@ -0,0 +1,39 @@
+//
+//  base64.hpp
+//  privavida-core
+//
+
+#pragma once
+#include <inttypes.h>
+
+// Standard base64 (RFC 4648, with the "+/" alphabet), using SIMD
+// instructions where the CPU has them (picked at runtime).
+//
+// Unlike c/base64.c these take explicit lengths (so there's no need to
+// NUL-terminate the input), and decoding rejects anything that isn't
+// valid base64 instead of stopping at the first invalid character.
+
+// The most bytes decoding input_len characters can produce
+static inline int base64_decoded_len_max(int input_len) {
+    return (input_len + 3) / 4 * 3;
+}
+
+// The number of characters encoding input_len bytes produces (padded)
+static inline int base64_encoded_len(int input_len) {
+    return (input_len + 2) / 3 * 4;
+}
+
+// Decodes the input, with or without padding. Returns the number of bytes
+// written to the output, or -1 if the input is invalid. The output needs
+// room for base64_decoded_len_max(input_len) bytes.
+int base64_decode(uint8_t* output, const char* input, int input_len);
+
+// Encodes the input with padding (and no NUL-terminal), returning the
+// number of characters written
+int base64_encode(char* output, const uint8_t* input, int input_len);
+
+#ifdef PRIVAVIDA_BENCHMARKS
+// Checks each of the implementations the CPU supports against the scalar
+// version and prints their throughput
+void base64_benchmark();
+#endif
@@ -41,45 +41,225 @@ static const WORD k[64] = {
 };
 
 /*********************** FUNCTION DEFINITIONS ***********************/
-void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
+
+// Each transform function processes `num_blocks` consecutive 64-byte
+// blocks of `data` into `state`. sha256_transform_c is the portable
+// version, and the others use the SHA instructions of the CPU (which
+// we check for at runtime in select_transform()).
+typedef void (*sha256_transform_fn)(WORD state[8], const BYTE data[], size_t num_blocks);
+
+static void sha256_transform_c(WORD state[8], const BYTE data[], size_t num_blocks)
 {
     WORD a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
-    for (i = 0, j = 0; i < 16; ++i, j += 4)
-        m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
-    for ( ; i < 64; ++i)
-        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-    a = ctx->state[0];
-    b = ctx->state[1];
-    c = ctx->state[2];
-    d = ctx->state[3];
-    e = ctx->state[4];
-    f = ctx->state[5];
-    g = ctx->state[6];
-    h = ctx->state[7];
-
-    for (i = 0; i < 64; ++i) {
-        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-        t2 = EP0(a) + MAJ(a,b,c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
+    for ( ; num_blocks > 0; --num_blocks, data += 64) {
+        for (i = 0, j = 0; i < 16; ++i, j += 4)
+            m[i] = (data[j] << 24) | (data[j + 1] << 16) | (data[j + 2] << 8) | (data[j + 3]);
+        for ( ; i < 64; ++i)
+            m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; ++i) {
+            t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+            t2 = EP0(a) + MAJ(a,b,c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86_SHA_NI
+#include <cpuid.h>
+#include <immintrin.h>
+
+// Intel SHA extensions. The state is kept as the two halves ABEF and
+// CDGH, which is the layout the sha256rnds2 instruction works on.
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_x86_sha_ni(WORD state[8], const BYTE data[], size_t num_blocks)
+{
+    const __m128i BSWAP_MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp;
+    __m128i msg0, msg1, msg2, msg3;
+    __m128i abef_save, cdgh_save;
+
+    // Load the state (ABCD, EFGH) and shuffle it into ABEF, CDGH
+    tmp    = _mm_loadu_si128((const __m128i*)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp    = _mm_shuffle_epi32(tmp, 0xB1);    // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+#define SHA256_ROUNDS_4(msg_i, ki) \
+    msg = _mm_add_epi32(msg_i, _mm_loadu_si128((const __m128i*)&k[ki])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg); \
+    msg = _mm_shuffle_epi32(msg, 0x0E); \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+// Computes the next 4 message words into msg_a from the previous 16
+#define SHA256_SCHEDULE(msg_a, msg_b, msg_c, msg_d) \
+    msg_a = _mm_sha256msg1_epu32(msg_a, msg_b); \
+    msg_a = _mm_add_epi32(msg_a, _mm_alignr_epi8(msg_d, msg_c, 4)); \
+    msg_a = _mm_sha256msg2_epu32(msg_a, msg_d);
+
+    for ( ; num_blocks > 0; --num_blocks, data += 64) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data +  0)), BSWAP_MASK);
+        msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), BSWAP_MASK);
+        msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), BSWAP_MASK);
+        msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), BSWAP_MASK);
+
+        SHA256_ROUNDS_4(msg0, 0);
+        SHA256_ROUNDS_4(msg1, 4);
+        SHA256_ROUNDS_4(msg2, 8);
+        SHA256_ROUNDS_4(msg3, 12);
+
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 16);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 20);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 24);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 28);
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 32);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 36);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 40);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 44);
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 48);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 52);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 56);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 60);
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
     }
 
-    ctx->state[0] += a;
-    ctx->state[1] += b;
-    ctx->state[2] += c;
-    ctx->state[3] += d;
-    ctx->state[4] += e;
-    ctx->state[5] += f;
-    ctx->state[6] += g;
-    ctx->state[7] += h;
+#undef SHA256_ROUNDS_4
+#undef SHA256_SCHEDULE
+
+    // Shuffle ABEF, CDGH back into ABCD, EFGH and store
+    tmp    = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static int has_x86_sha_ni(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    if (!(ecx & (1 << 19))) return 0; // SSE4.1
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return 0;
+    return (ebx & (1 << 29)) != 0; // SHA
+}
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define SHA256_ARMV8
+#include <arm_neon.h>
+
+// ARMv8 crypto extensions. These are available on every 64-bit Apple
+// device, and we only build this when the compiler targets them.
+static void sha256_transform_armv8(WORD state[8], const BYTE data[], size_t num_blocks)
+{
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+    uint32x4_t abcd_save, efgh_save, msg0, msg1, msg2, msg3, tmp0, tmp2;
+
+#define SHA256_ROUNDS_4(msg_i, ki) \
+    tmp0 = vaddq_u32(msg_i, vld1q_u32(&k[ki])); \
+    tmp2 = state0; \
+    state0 = vsha256hq_u32(state0, state1, tmp0); \
+    state1 = vsha256h2q_u32(state1, tmp2, tmp0);
+
+#define SHA256_SCHEDULE(msg_a, msg_b, msg_c, msg_d) \
+    msg_a = vsha256su1q_u32(vsha256su0q_u32(msg_a, msg_b), msg_c, msg_d);
+
+    for ( ; num_blocks > 0; --num_blocks, data += 64) {
+        abcd_save = state0;
+        efgh_save = state1;
+
+        msg0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data +  0)));
+        msg1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16)));
+        msg2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 32)));
+        msg3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 48)));
+
+        SHA256_ROUNDS_4(msg0, 0);
+        SHA256_ROUNDS_4(msg1, 4);
+        SHA256_ROUNDS_4(msg2, 8);
+        SHA256_ROUNDS_4(msg3, 12);
+
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 16);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 20);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 24);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 28);
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 32);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 36);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 40);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 44);
+        SHA256_SCHEDULE(msg0, msg1, msg2, msg3); SHA256_ROUNDS_4(msg0, 48);
+        SHA256_SCHEDULE(msg1, msg2, msg3, msg0); SHA256_ROUNDS_4(msg1, 52);
+        SHA256_SCHEDULE(msg2, msg3, msg0, msg1); SHA256_ROUNDS_4(msg2, 56);
+        SHA256_SCHEDULE(msg3, msg0, msg1, msg2); SHA256_ROUNDS_4(msg3, 60);
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+    }
+
+#undef SHA256_ROUNDS_4
+#undef SHA256_SCHEDULE
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+static sha256_transform_fn select_transform(void)
+{
+#if defined(SHA256_X86_SHA_NI)
+    if (has_x86_sha_ni()) return sha256_transform_x86_sha_ni;
+#endif
+#if defined(SHA256_ARMV8)
+    return sha256_transform_armv8;
+#endif
+    return sha256_transform_c;
+}
+
+// Selecting the transform is idempotent, so it doesn't matter if two
+// threads happen to race on it
+static sha256_transform_fn sha256_transform_impl = NULL;
+
+static void sha256_transform(SHA256_CTX *ctx, const BYTE data[], size_t num_blocks)
+{
+    if (!sha256_transform_impl) {
+        sha256_transform_impl = select_transform();
+    }
+    sha256_transform_impl(ctx->state, data, num_blocks);
 }
 
 void sha256_init(SHA256_CTX *ctx)
@@ -98,17 +278,35 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-    WORD i;
+    size_t num_blocks, n;
 
-    for (i = 0; i < len; ++i) {
-        ctx->data[ctx->datalen] = data[i];
-        ctx->datalen++;
-        if (ctx->datalen == 64) {
-            sha256_transform(ctx, ctx->data);
-            ctx->bitlen += 512;
-            ctx->datalen = 0;
-        }
+    // Top up a partially filled block first
+    if (ctx->datalen > 0) {
+        n = 64 - ctx->datalen;
+        if (n > len) n = len;
+        memcpy(&ctx->data[ctx->datalen], data, n);
+        ctx->datalen += n;
+        data += n;
+        len -= n;
+        if (ctx->datalen < 64) return;
+
+        sha256_transform(ctx, ctx->data, 1);
+        ctx->bitlen += 512;
+        ctx->datalen = 0;
     }
+
+    // Then hash all full blocks straight from the input
+    num_blocks = len / 64;
+    if (num_blocks > 0) {
+        sha256_transform(ctx, data, num_blocks);
+        ctx->bitlen += 512 * (unsigned long long)num_blocks;
+        data += num_blocks * 64;
+        len -= num_blocks * 64;
+    }
+
+    // And keep the rest for later
+    memcpy(ctx->data, data, len);
+    ctx->datalen = len;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
@@ -127,7 +325,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
         ctx->data[i++] = 0x80;
         while (i < 64)
             ctx->data[i++] = 0x00;
-        sha256_transform(ctx, ctx->data);
+        sha256_transform(ctx, ctx->data, 1);
         memset(ctx->data, 0, 56);
     }
 
@@ -141,7 +339,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
     ctx->data[58] = ctx->bitlen >> 40;
     ctx->data[57] = ctx->bitlen >> 48;
     ctx->data[56] = ctx->bitlen >> 56;
-    sha256_transform(ctx, ctx->data);
+    sha256_transform(ctx, ctx->data, 1);
 
     // Since this implementation uses little endian byte ordering and SHA uses big endian,
     // reverse all the bytes when copying the final state to the output hash.
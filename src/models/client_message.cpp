@@ -32,6 +32,10 @@ struct StackBufferWriter {
 static void write_filters(rapidjson::Writer<StackBufferWriter>& writer, const Filters* filters);
 
 const char* client_message_req(const char* subscription_id, const Filters* filters, StackBuffer* stack_buffer) {
+    return client_message_req(subscription_id, &filters, 1, stack_buffer);
+}
+
+const char* client_message_req(const char* subscription_id, const Filters* const* filters, uint32_t num_filters, StackBuffer* stack_buffer) {
 
     StackBufferWriter sb(stack_buffer);
     rapidjson::Writer<StackBufferWriter> writer(sb);
@@ -39,7 +43,9 @@ const char* client_message_req(const char* subscription_id, const Filters* filte
     writer.StartArray();
     writer.String("REQ");
     writer.String(subscription_id);
-    write_filters(writer, filters);
+    for (uint32_t i = 0; i < num_filters; ++i) {
+        write_filters(writer, filters[i]);
+    }
     writer.EndArray();
 
     return (const char*)stack_buffer->data;
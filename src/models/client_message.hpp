@@ -12,5 +12,6 @@
 #include "../utils/stackbuffer.hpp"
 
 const char* client_message_req(const char* subscription_id, const Filters* filters, StackBuffer* stack_buffer);
+const char* client_message_req(const char* subscription_id, const Filters* const* filters, uint32_t num_filters, StackBuffer* stack_buffer);
 const char* client_message_event(const Event* event, StackBuffer* stack_buffer);
 const char* client_message_close(const char* subscription_id, StackBuffer* stack_buffer);
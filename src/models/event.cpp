@@ -8,8 +8,11 @@
 #include "event.hpp"
 
 #include "hex.hpp"
+#include "verified_ids.hpp"
 #include "time.h"
 #include <rapidjson/writer.h>
+#include <algorithm>
+#include <vector>
 
 extern "C" {
 #include "c/sha256.h"
@@ -21,14 +24,25 @@ static_assert(sizeof(EventId) == 32);
 // This is struct that implements the rapidjson interface for
 // an output stream. This allows us to stream the output from
 // the rapidjson JSON writer directly into the sha256 algo.
+// The output is collected in a buffer, so that it can be hashed
+// a bunch of blocks at a time rather than byte by byte.
 struct Sha256Writer {
     typedef char Ch;
 
     SHA256_CTX* ctx;
+    uint8_t buffer[512];
+    uint32_t buffer_len = 0;
+
     void Put(char c) {
-        sha256_update(ctx, (uint8_t*)&c, 1);
+        buffer[buffer_len++] = (uint8_t)c;
+        if (buffer_len == sizeof(buffer)) {
+            Flush();
+        }
+    }
+    void Flush() {
+        sha256_update(ctx, buffer, buffer_len);
+        buffer_len = 0;
     }
-    void Flush() {}
 };
 
 void event_compute_hash(const Event* event, EventId* hash_out) {
@@ -89,31 +103,71 @@ void event_compute_hash(const Event* event, EventId* hash_out) {
     }
     writer.EndArray();
 
+    sha256_writer.Flush();
     sha256_final(&ctx, hash_out->data);
 }
 
 bool event_validate(Event* event) {
+    event_validate_batch(&event, 1);
+    return event->validity == EVENT_VALID;
+}
+
+void event_validate_batch(Event** events, uint32_t count) {
 
     static auto secp256k1_context = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 
-    // Check the hash
-    EventId hash_computed;
-    event_compute_hash(event, &hash_computed);
-    if (!compare_keys(&event->id, &hash_computed)) {
-        event->validity = EVENT_INVALID_ID;
-        return false;
+    // Go through the events grouped by author, so that we only need
+    // to parse each author's pubkey once
+    Event** events_sorted = events;
+    std::vector<Event*> events_sorted_vec;
+    if (count > 1) {
+        events_sorted_vec.assign(events, events + count);
+        std::stable_sort(events_sorted_vec.begin(), events_sorted_vec.end(), [](const Event* a, const Event* b) {
+            return memcmp(a->pubkey.data, b->pubkey.data, sizeof(Pubkey)) < 0;
+        });
+        events_sorted = events_sorted_vec.data();
     }
 
-    // Verify signature
     secp256k1_xonly_pubkey pubkey;
-    if (!secp256k1_xonly_pubkey_parse(secp256k1_context, &pubkey, event->pubkey.data) ||
-        !secp256k1_schnorrsig_verify(secp256k1_context, event->sig.data, event->id.data, 32, &pubkey)) {
-        event->validity = EVENT_INVALID_SIG;
-        return false;
-    }
+    const Pubkey* pubkey_parsed = NULL;
 
-    event->validity = EVENT_VALID;
-    return true;
+    for (uint32_t i = 0; i < count; ++i) {
+        auto event = events_sorted[i];
+
+        // Check the hash
+        EventId hash_computed;
+        event_compute_hash(event, &hash_computed);
+        if (!compare_keys(&event->id, &hash_computed)) {
+            event->validity = EVENT_INVALID_ID;
+            continue;
+        }
+
+        // The id covers everything the signature does, so if we've
+        // verified this id and sig before we know the signature is good
+        if (verified_ids_contains(&event->id, &event->sig)) {
+            event->validity = EVENT_VALID;
+            continue;
+        }
+
+        // Parse the pubkey (unless it's the same author as before)
+        if (!pubkey_parsed || !compare_keys(pubkey_parsed, &event->pubkey)) {
+            pubkey_parsed = NULL;
+            if (!secp256k1_xonly_pubkey_parse(secp256k1_context, &pubkey, event->pubkey.data)) {
+                event->validity = EVENT_INVALID_SIG;
+                continue;
+            }
+            pubkey_parsed = &event->pubkey;
+        }
+
+        // Verify signature
+        if (!secp256k1_schnorrsig_verify(secp256k1_context, event->sig.data, event->id.data, 32, &pubkey)) {
+            event->validity = EVENT_INVALID_SIG;
+            continue;
+        }
+
+        verified_ids_insert(&event->id, &event->sig);
+        event->validity = EVENT_VALID;
+    }
 }
 
 bool event_finish(Event* event, const Seckey* seckey) {
@@ -138,5 +192,10 @@ bool event_finish(Event* event, const Seckey* seckey) {
         }
     }
 
-    return event_validate(event);
+    // We just computed the id and signed it, so there's nothing to
+    // verify. Caching it means the copies the relays send back to us
+    // aren't verified either.
+    event->validity = EVENT_VALID;
+    verified_ids_insert(&event->id, &event->sig);
+    return true;
 }
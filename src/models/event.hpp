@@ -133,7 +133,8 @@ struct Event {
 /// event_finish()
 //
 //   Will set the created_at property, the pubkey property,
-//   compute the hash, and sign the event.
+//   compute the hash, and sign the event. The signed event is
+//   marked valid and added to the verified ids cache.
 //
 bool event_finish(Event* event, const Seckey* seckey);
 
@@ -153,3 +154,14 @@ void event_compute_hash(const Event* event, EventId* hash_out);
 //   event is valid.
 //
 bool event_validate(Event* event);
+
+//
+/// event_validate_batch()
+//
+//   Validates a batch of events, setting the validity property of
+//   each one. Every event is still checked on its own (an invalid
+//   event doesn't affect the others), but the work that can be
+//   shared between events, such as parsing the pubkey of an author
+//   with many events in the batch, is only done once.
+//
+void event_validate_batch(Event** events, uint32_t count);
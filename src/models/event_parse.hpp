@@ -46,3 +46,8 @@ struct EventParseResult {
 };
 
 ParseError event_parse(const char* input, size_t input_len, StackBuffer* stack_buffer, Event** event_out);
+
+// Same as event_parse, but strings are unescaped in place in the (NUL
+// terminated) input, so each string gets copied just once, straight into
+// the Event. The input is garbage afterwards.
+ParseError event_parse_insitu(char* input, size_t input_len, StackBuffer* stack_buffer, Event** event_out);
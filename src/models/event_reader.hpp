@@ -0,0 +1,444 @@
+//
+//  event_reader.hpp
+//  privavida-core
+//
+
+#pragma once
+#include "event.hpp"
+#include "event_parse.hpp"
+#include "hex.hpp"
+#include "../utils/stackbuffer.hpp"
+#include <string.h>
+#include <rapidjson/reader.h>
+
+// The EventReader struct implements rapidjson's BaseReaderHandler
+// class. It receives tokens as they are parsed by rapidjson and builds
+// the final Event struct straight away, so the event JSON only has to
+// be traversed once. It's used by event_parse(), and by
+// relay_message_parse() to parse the event inside an EVENT message in
+// the same pass as the message itself.
+//
+// The Event is laid out in the StackBuffer as follows:
+//
+//     [Event][content & tag value strings][e_tags][p_tags][tag values][tags][receipt info]
+//
+// The strings are written into the buffer as they are parsed. As the
+// unescaped strings are never longer than the JSON they came from, we
+// reserve sizeof(Event) + input_len up front (in start()) so that this
+// never has to grow the buffer. The arrays are collected on the side (as we only know
+// their sizes at the end), and are copied in by finish(), which leaves
+// the buffer holding exactly Event::size_of(event) bytes of event.
+
+struct EventReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, EventReader> {
+    enum ReaderState {
+        STATE_STARTED,
+        STATE_IN_ROOT,
+        STATE_AT_ID,
+        STATE_AT_PUBKEY,
+        STATE_AT_SIG,
+        STATE_AT_KIND,
+        STATE_AT_CREATED_AT,
+        STATE_AT_CONTENT,
+        STATE_AT_TAGS,
+        STATE_IN_TAGS,
+        STATE_IN_TAG,
+        STATE_IN_OTHER,
+        STATE_ENDED
+    };
+
+    enum Flags : uint8_t {
+        FLAG_HAS_ID         = 0x01,
+        FLAG_HAS_PUBKEY     = 0x02,
+        FLAG_HAS_SIG        = 0x04,
+        FLAG_HAS_KIND       = 0x08,
+        FLAG_HAS_CONTENT    = 0x10,
+        FLAG_HAS_CREATED_AT = 0x20,
+        FLAG_HAS_TAGS       = 0x40,
+    };
+
+    static constexpr int RECEIPT_INFO_SPACE = 16;
+
+    StackBuffer* buffer;
+    uint32_t buffer_used;
+
+    uint8_t flags = 0;
+    ParseError err = PARSE_NO_ERR;
+    ReaderState state = STATE_STARTED;
+    int other_depth;
+    uint32_t tag_start; // Index of the current tag's first value in tag_values
+
+    // The tags are collected here and copied into the event by finish().
+    // The tags' data offsets are indices into tag_values until then.
+    StackArrayFixed<RelString, 64>           tag_values;
+    StackArrayFixed<RelArray<RelString>, 16> tags;
+    StackArrayFixed<ETag, 8>                 e_tags;
+    StackArrayFixed<PTag, 8>                 p_tags;
+
+    EventReader(StackBuffer* buffer_) : buffer(buffer_), buffer_used(0) {}
+
+    // Call this before handing the reader any tokens. input_len should
+    // be the length of (or an upper bound on the length of) the event JSON.
+    void start(size_t input_len) {
+        buffer_used = sizeof(Event);
+        buffer->reserve(sizeof(Event) + input_len);
+        memset(get(), 0, sizeof(Event));
+    }
+
+    Event* get() {
+        return (Event*)buffer->data;
+    }
+
+    // Checks that all required fields are there, and copies the arrays
+    // into the event. Returns NULL (and sets err) if the event is invalid.
+    Event* finish() {
+        if (state != STATE_ENDED) {
+            if (!err) err = PARSE_ERR_INVALID_JSON;
+            return NULL;
+        }
+
+        if (!(flags & FLAG_HAS_ID))         return finish_error(PARSE_ERR_MISSING_ID);
+        if (!(flags & FLAG_HAS_PUBKEY))     return finish_error(PARSE_ERR_MISSING_PUBKEY);
+        if (!(flags & FLAG_HAS_SIG))        return finish_error(PARSE_ERR_MISSING_SIG);
+        if (!(flags & FLAG_HAS_KIND))       return finish_error(PARSE_ERR_MISSING_KIND);
+        if (!(flags & FLAG_HAS_CREATED_AT)) return finish_error(PARSE_ERR_MISSING_CREATED_AT);
+        if (!(flags & FLAG_HAS_CONTENT)) {
+            get()->content = copy_string("", 0);
+        }
+
+        // Now we know the sizes of all the arrays, so we can reserve
+        // exactly what's left to go
+        buffer_used = align_8(buffer_used);
+        buffer->reserve(
+            buffer_used +
+            e_tags.size * sizeof(ETag) +
+            p_tags.size * sizeof(PTag) +
+            tag_values.size * sizeof(RelString) +
+            tags.size * sizeof(RelArray<RelString>) +
+            RECEIPT_INFO_SPACE * sizeof(ReceiptInfo)
+        );
+
+        get()->e_tags = copy_array(e_tags.begin(), (uint32_t)e_tags.size);
+        get()->p_tags = copy_array(p_tags.begin(), (uint32_t)p_tags.size);
+
+        auto tag_values_out = copy_array(tag_values.begin(), (uint32_t)tag_values.size);
+        for (auto& tag : tags) {
+            tag.data.offset = tag_values_out.data.offset + tag.data.offset * sizeof(RelString);
+        }
+        get()->tags = copy_array(tags.begin(), (uint32_t)tags.size);
+
+        // Allocate space for receipt info metadata
+        auto receipt_info = copy_array((ReceiptInfo*)NULL, RECEIPT_INFO_SPACE);
+        memset((uint8_t*)get() + receipt_info.data.offset, 0, RECEIPT_INFO_SPACE * sizeof(ReceiptInfo));
+        get()->receipt_info.size = 0;
+        get()->receipt_info.space = RECEIPT_INFO_SPACE;
+        get()->receipt_info.data = receipt_info.data;
+
+        // The size has to fit in the 24 bits of the event header
+        if (buffer_used > 0x00FFFFFF) {
+            return finish_error(PARSE_ERR_INVALID_EVENT);
+        }
+
+        Event::set_size(get(), buffer_used);
+        return get();
+    }
+
+    bool error(ParseError err) {
+        this->err = err;
+        return false;
+    }
+    bool error() {
+        switch (state) {
+            case STATE_STARTED:       err = PARSE_ERR_INVALID_EVENT;      break;
+            case STATE_IN_ROOT:       err = PARSE_ERR_INVALID_EVENT;      break;
+            case STATE_AT_ID:         err = PARSE_ERR_INVALID_ID;         break;
+            case STATE_AT_PUBKEY:     err = PARSE_ERR_INVALID_PUBKEY;     break;
+            case STATE_AT_SIG:        err = PARSE_ERR_INVALID_SIG;        break;
+            case STATE_AT_KIND:       err = PARSE_ERR_INVALID_KIND;       break;
+            case STATE_AT_CREATED_AT: err = PARSE_ERR_INVALID_CREATED_AT; break;
+            case STATE_AT_CONTENT:    err = PARSE_ERR_INVALID_CONTENT;    break;
+            case STATE_AT_TAGS:       err = PARSE_ERR_INVALID_TAGS;       break;
+            case STATE_IN_TAGS:       err = PARSE_ERR_INVALID_TAGS;       break;
+            case STATE_IN_TAG:        err = PARSE_ERR_INVALID_TAGS;       break;
+            case STATE_IN_OTHER:      err = PARSE_ERR_INVALID_EVENT;      break;
+            case STATE_ENDED:         err = PARSE_ERR_INVALID_EVENT;      break;
+        }
+        return false;
+    }
+    bool done() {
+        state = STATE_ENDED;
+        return false;
+    }
+
+    bool Null() {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+        } else if (state == STATE_AT_CONTENT || state == STATE_AT_TAGS) {
+            state = STATE_IN_ROOT;
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool Bool(bool b) {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+            return true;
+        }
+        return error();
+    }
+    bool Int(int i) {
+        if (i >= 0) return Uint(i);
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+            return true;
+        }
+        return error();
+    }
+    bool Uint(unsigned u) {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+        } else if (state == STATE_AT_KIND) {
+            state = STATE_IN_ROOT;
+            get()->kind = u;
+        } else if (state == STATE_AT_CREATED_AT) {
+            state = STATE_IN_ROOT;
+            get()->created_at = u;
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool Int64(int64_t i) {
+        if (i >= 0) return Uint64(i);
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+            return true;
+        }
+        return error();
+    }
+    bool Uint64(uint64_t u) {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+        } else if (state == STATE_AT_CREATED_AT) {
+            state = STATE_IN_ROOT;
+            get()->created_at = u;
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool Double(double d) {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+            return true;
+        }
+        return error();
+    }
+    bool String(const char* str, rapidjson::SizeType length, bool copy) {
+        if (state == STATE_IN_OTHER) {
+            state = other_depth ? STATE_IN_OTHER : STATE_IN_ROOT;
+        } else if (state == STATE_AT_ID) {
+            if (length != 2 * sizeof(EventId)) return error();
+            if (!hex_decode(get()->id.data, str, sizeof(EventId))) return error();
+            state = STATE_IN_ROOT;
+        } else if (state == STATE_AT_PUBKEY) {
+            if (length != 2 * sizeof(Pubkey)) return error();
+            if (!hex_decode(get()->pubkey.data, str, sizeof(Pubkey))) return error();
+            state = STATE_IN_ROOT;
+        } else if (state == STATE_AT_SIG) {
+            if (length != 2 * sizeof(Signature)) return error();
+            if (!hex_decode(get()->sig.data, str, sizeof(Signature))) return error();
+            state = STATE_IN_ROOT;
+        } else if (state == STATE_AT_CONTENT) {
+            get()->content = copy_string(str, length);
+            state = STATE_IN_ROOT;
+        } else if (state == STATE_IN_TAG) {
+            tag_values.push_back(copy_string(str, length));
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool StartObject() {
+        if (state == STATE_STARTED) {
+            state = STATE_IN_ROOT;
+        } else if (state == STATE_IN_OTHER) {
+            other_depth++;
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool Key(const char* str, rapidjson::SizeType length, bool copy) {
+        if (state == STATE_IN_OTHER) return true;
+        if (state != STATE_IN_ROOT)  return error();
+
+        if (strcmp("id", str) == 0) {
+            if (flags & FLAG_HAS_ID) return error(PARSE_ERR_DUPLICATE_ID);
+            flags |= FLAG_HAS_ID;
+            state = STATE_AT_ID;
+        } else if (strcmp("pubkey", str) == 0) {
+            if (flags & FLAG_HAS_PUBKEY) return error(PARSE_ERR_DUPLICATE_PUBKEY);
+            flags |= FLAG_HAS_PUBKEY;
+            state = STATE_AT_PUBKEY;
+        } else if (strcmp("sig", str) == 0) {
+            if (flags & FLAG_HAS_SIG) return error(PARSE_ERR_DUPLICATE_SIG);
+            flags |= FLAG_HAS_SIG;
+            state = STATE_AT_SIG;
+        } else if (strcmp("kind", str) == 0) {
+            if (flags & FLAG_HAS_KIND) return error(PARSE_ERR_DUPLICATE_KIND);
+            flags |= FLAG_HAS_KIND;
+            state = STATE_AT_KIND;
+        } else if (strcmp("created_at", str) == 0) {
+            if (flags & FLAG_HAS_CREATED_AT) return error(PARSE_ERR_DUPLICATE_CREATED_AT);
+            flags |= FLAG_HAS_CREATED_AT;
+            state = STATE_AT_CREATED_AT;
+        } else if (strcmp("content", str) == 0) {
+            if (flags & FLAG_HAS_CONTENT) return error(PARSE_ERR_DUPLICATE_CONTENT);
+            flags |= FLAG_HAS_CONTENT;
+            state = STATE_AT_CONTENT;
+        } else if (strcmp("tags", str) == 0) {
+            if (flags & FLAG_HAS_TAGS) return error(PARSE_ERR_DUPLICATE_TAGS);
+            flags |= FLAG_HAS_TAGS;
+            state = STATE_AT_TAGS;
+        } else {
+            state = STATE_IN_OTHER;
+            other_depth = 0;
+        }
+
+        return true;
+    }
+    bool EndObject(rapidjson::SizeType memberCount) {
+        if (state == STATE_IN_OTHER) {
+            if (--other_depth <= 0) {
+                state = STATE_IN_ROOT;
+            }
+            return true;
+        } else if (state == STATE_IN_ROOT) {
+            return done();
+        }
+        return error();
+    }
+    bool StartArray() {
+        if (state == STATE_IN_OTHER) {
+            other_depth++;
+        } else if (state == STATE_AT_TAGS) {
+            state = STATE_IN_TAGS;
+        } else if (state == STATE_IN_TAGS) {
+            tag_start = (uint32_t)tag_values.size;
+            state = STATE_IN_TAG;
+        } else {
+            return error();
+        }
+        return true;
+    }
+    bool EndArray(rapidjson::SizeType elementCount) {
+        if (state == STATE_IN_OTHER) {
+            if (--other_depth <= 0) {
+                state = STATE_IN_ROOT;
+            }
+        } else if (state == STATE_IN_TAG) {
+            if (elementCount == 0) return error();
+            tags.push_back(RelArray<RelString>(elementCount, tag_start));
+            parse_e_or_p_tag((uint32_t)tags.size - 1);
+            state = STATE_IN_TAGS;
+        } else if (state == STATE_IN_TAGS) {
+            state = STATE_IN_ROOT;
+        } else {
+            return error();
+        }
+        return true;
+    }
+
+private:
+    static uint32_t align_8(uint32_t n) {
+        return n + (8 - n % 8) % 8;
+    }
+
+    Event* finish_error(ParseError err) {
+        this->err = err;
+        return NULL;
+    }
+
+    RelString copy_string(const char* string, uint32_t len) {
+        buffer->reserve(buffer_used + len + 1);
+
+        auto ptr = (char*)buffer->data + buffer_used;
+        memcpy(ptr, string, len);
+        ptr[len] = '\0';
+
+        RelString rel_string;
+        rel_string.size = len;
+        rel_string.data.offset = buffer_used;
+        buffer_used += len + 1;
+        return rel_string;
+    }
+
+    // Copies the array to the end of the event (the space for which
+    // has to be reserved already). If data is NULL the space is only
+    // claimed, not written to.
+    template <typename T>
+    RelArray<T> copy_array(const T* data, uint32_t size) {
+        RelArray<T> rel_array(size, buffer_used);
+        if (data) {
+            memcpy((uint8_t*)buffer->data + buffer_used, data, size * sizeof(T));
+        }
+        buffer_used += size * sizeof(T);
+        return rel_array;
+    }
+
+    const char* tag_value(uint32_t tag_index, uint32_t value_index) {
+        auto& value = tag_values[tags[tag_index].data.offset + value_index];
+        return value.data.get(buffer->data);
+    }
+
+    void parse_e_or_p_tag(uint32_t tag_index) {
+        auto& tag = tags[tag_index];
+        if (tag.size < 2) return;
+
+        auto name = tag_value(tag_index, 0);
+        auto value = tag_value(tag_index, 1);
+
+        if (strcmp(name, "e") == 0) {
+
+            // Expecting:
+            // ["e", <event-id>] or
+            // ["e", <event-id>, <relay-url>] or
+            // ["e", <event-id>, <relay-url>, <marker>]
+
+            ETag e_tag;
+            e_tag.index = tag_index;
+            e_tag.marker = ETag::NO_MARKER;
+
+            if (strlen(value) != 2 * sizeof(EventId)) return;
+            if (!hex_decode(e_tag.event_id.data, value, sizeof(EventId))) return;
+
+            if (tag.size == 4) {
+                auto marker = tag_value(tag_index, 3);
+                if (strcmp(marker, "reply") == 0) {
+                    e_tag.marker = ETag::REPLY;
+                } else if (strcmp(marker, "root") == 0) {
+                    e_tag.marker = ETag::ROOT;
+                } else if (strcmp(marker, "mention") == 0) {
+                    e_tag.marker = ETag::MENTION;
+                }
+            }
+
+            e_tags.push_back(e_tag);
+
+        } else if (strcmp(name, "p") == 0) {
+
+            // Expecting:
+            // ["p", <pubkey>]
+
+            PTag p_tag;
+            p_tag.index = tag_index;
+
+            if (strlen(value) != 2 * sizeof(Pubkey)) return;
+            if (!hex_decode(p_tag.pubkey.data, value, sizeof(Pubkey))) return;
+
+            p_tags.push_back(p_tag);
+
+        }
+    }
+};
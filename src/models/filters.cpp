@@ -0,0 +1,81 @@
+//
+//  filters.cpp
+//  privavida-core
+//
+
+#include "filters.hpp"
+#include "event.hpp"
+
+bool filters_match(const Filters* filters, const Event* event) {
+
+    if (filters->since != -1 && event->created_at < filters->since) return false;
+    if (filters->until != -1 && event->created_at > filters->until) return false;
+
+    // kinds
+    if (filters->kinds.size) {
+        bool found = false;
+        for (auto kind : filters->kinds.get(filters)) {
+            if (kind == event->kind) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
+    }
+
+    // ids
+    if (filters->ids.size) {
+        bool found = false;
+        for (auto& id : filters->ids.get(filters)) {
+            if (compare_keys(&id, &event->id)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
+    }
+
+    // authors
+    if (filters->authors.size) {
+        bool found = false;
+        for (auto& pubkey : filters->authors.get(filters)) {
+            if (compare_keys(&pubkey, &event->pubkey)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found) return false;
+    }
+
+    // e_tags (matches if any of the event's e tags is in the filter)
+    if (filters->e_tags.size) {
+        bool found = false;
+        for (auto& e_tag : event->e_tags.get(event)) {
+            for (auto& id : filters->e_tags.get(filters)) {
+                if (compare_keys(&id, &e_tag.event_id)) {
+                    found = true;
+                    break;
+                }
+            }
+            if (found) break;
+        }
+        if (!found) return false;
+    }
+
+    // p_tags (matches if any of the event's p tags is in the filter)
+    if (filters->p_tags.size) {
+        bool found = false;
+        for (auto& p_tag : event->p_tags.get(event)) {
+            for (auto& pubkey : filters->p_tags.get(filters)) {
+                if (compare_keys(&pubkey, &p_tag.pubkey)) {
+                    found = true;
+                    break;
+                }
+            }
+            if (found) break;
+        }
+        if (!found) return false;
+    }
+
+    return true;
+}
@@ -33,6 +33,17 @@ struct Filters {
     }
 };
 
+struct Event;
+
+//
+/// filters_match()
+//
+//   Returns true if the event matches the filters, following the
+//   NIP-01 rules (every field that is set must match). The limit
+//   field is not taken into account.
+//
+bool filters_match(const Filters* filters, const Event* event);
+
 struct FiltersBuilder {
     StackBuffer* buffer;
     uint32_t buffer_used;
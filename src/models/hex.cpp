@@ -7,6 +7,19 @@
 
 #include "hex.hpp"
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HEX_X86
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__)
+#define HEX_NEON
+#include <arm_neon.h>
+#endif
+#if defined(__wasm_simd128__)
+#define HEX_WASM_SIMD
+#include <wasm_simd128.h>
+#endif
+
 const char hex_lookup[16] = {
     '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
 };
@@ -22,7 +35,16 @@ const int8_t hex_lookup_rev[128] = {
     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
 };
 
-bool hex_decode(uint8_t* output, const char* input, int output_len) {
+// Each of the vectorized versions works through as many whole vectors
+// as it can and then leaves the remaining few bytes to the scalar version.
+// They all compute a nibble from each character the same way:
+//
+//     '0'-'9' -> c - '0'
+//     'a'-'f' -> (c | 0x20) - 'a' + 10 (which covers 'A'-'F' as well)
+//
+// and reject the whole input if any character is in neither range.
+
+static bool hex_decode_scalar(uint8_t* output, const char* input, int output_len) {
     const char* in = input;
     const char* in_end = input + 2*output_len;
     uint8_t* out = output;
@@ -41,9 +63,348 @@ bool hex_decode(uint8_t* output, const char* input, int output_len) {
     return true;
 }
 
-void hex_encode(char* output, const uint8_t* input, int input_len) {
+static void hex_encode_scalar(char* output, const uint8_t* input, int input_len) {
     for (int i = 0; i < input_len; ++i) {
         *output++ = hex_lookup[input[i] / 16];
         *output++ = hex_lookup[input[i] % 16];
     }
 }
+
+#ifdef HEX_X86
+
+// SSSE3: 16 characters -> 8 bytes per iteration
+__attribute__((target("ssse3")))
+static bool hex_decode_ssse3(uint8_t* output, const char* input, int output_len) {
+    const __m128i ascii_0  = _mm_set1_epi8('0');
+    const __m128i ascii_a  = _mm_set1_epi8('a' - 10);
+    const __m128i below_0  = _mm_set1_epi8('0' - 1);
+    const __m128i above_9  = _mm_set1_epi8('9' + 1);
+    const __m128i below_a  = _mm_set1_epi8('a' - 1);
+    const __m128i above_f  = _mm_set1_epi8('f' + 1);
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    const __m128i weights  = _mm_set1_epi16(0x0110); // (high nibble * 16) + (low nibble * 1)
+
+    for (; output_len >= 8; output_len -= 8, input += 16, output += 8) {
+        __m128i chars = _mm_loadu_si128((const __m128i*)input);
+        __m128i lower = _mm_or_si128(chars, case_bit);
+
+        // Signed compares, so any non-ASCII byte fails both ranges
+        __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chars, below_0), _mm_cmplt_epi8(chars, above_9));
+        __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, below_a), _mm_cmplt_epi8(lower, above_f));
+        if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF) return false;
+
+        __m128i nibbles = _mm_or_si128(
+            _mm_and_si128(is_digit, _mm_sub_epi8(chars, ascii_0)),
+            _mm_and_si128(is_alpha, _mm_sub_epi8(lower, ascii_a))
+        );
+        __m128i bytes = _mm_maddubs_epi16(nibbles, weights);
+        _mm_storel_epi64((__m128i*)output, _mm_packus_epi16(bytes, bytes));
+    }
+
+    return hex_decode_scalar(output, input, output_len);
+}
+
+// SSSE3: 16 bytes -> 32 characters per iteration
+__attribute__((target("ssse3")))
+static void hex_encode_ssse3(char* output, const uint8_t* input, int input_len) {
+    const __m128i lookup = _mm_loadu_si128((const __m128i*)hex_lookup);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    for (; input_len >= 16; input_len -= 16, input += 16, output += 32) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)input);
+        __m128i high = _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(bytes, 4), mask));
+        __m128i low  = _mm_shuffle_epi8(lookup, _mm_and_si128(bytes, mask));
+        _mm_storeu_si128((__m128i*)&output[0],  _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i*)&output[16], _mm_unpackhi_epi8(high, low));
+    }
+
+    hex_encode_scalar(output, input, input_len);
+}
+
+// AVX2: 32 characters -> 16 bytes per iteration
+__attribute__((target("avx2")))
+static bool hex_decode_avx2(uint8_t* output, const char* input, int output_len) {
+    const __m256i ascii_0  = _mm256_set1_epi8('0');
+    const __m256i ascii_a  = _mm256_set1_epi8('a' - 10);
+    const __m256i below_0  = _mm256_set1_epi8('0' - 1);
+    const __m256i below_a  = _mm256_set1_epi8('a' - 1);
+    const __m256i above_9  = _mm256_set1_epi8('9' + 1);
+    const __m256i above_f  = _mm256_set1_epi8('f' + 1);
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    const __m256i weights  = _mm256_set1_epi16(0x0110);
+
+    for (; output_len >= 16; output_len -= 16, input += 32, output += 16) {
+        __m256i chars = _mm256_loadu_si256((const __m256i*)input);
+        __m256i lower = _mm256_or_si256(chars, case_bit);
+
+        __m256i is_digit = _mm256_and_si256(_mm256_cmpgt_epi8(chars, below_0), _mm256_cmpgt_epi8(above_9, chars));
+        __m256i is_alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, below_a), _mm256_cmpgt_epi8(above_f, lower));
+        if (_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_alpha)) != -1) return false;
+
+        __m256i nibbles = _mm256_or_si256(
+            _mm256_and_si256(is_digit, _mm256_sub_epi8(chars, ascii_0)),
+            _mm256_and_si256(is_alpha, _mm256_sub_epi8(lower, ascii_a))
+        );
+        __m256i bytes = _mm256_maddubs_epi16(nibbles, weights);
+
+        // packus works within each 128-bit lane, so gather the low
+        // 8 bytes of both lanes together
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(bytes, bytes), 0x08);
+        _mm_storeu_si128((__m128i*)output, _mm256_castsi256_si128(packed));
+    }
+
+    return hex_decode_ssse3(output, input, output_len);
+}
+
+// AVX2: 32 bytes -> 64 characters per iteration
+__attribute__((target("avx2")))
+static void hex_encode_avx2(char* output, const uint8_t* input, int input_len) {
+    const __m256i lookup = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)hex_lookup));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+
+    for (; input_len >= 32; input_len -= 32, input += 32, output += 64) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)input);
+        __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), mask));
+        __m256i low  = _mm256_shuffle_epi8(lookup, _mm256_and_si256(bytes, mask));
+
+        // The unpacks also work within each 128-bit lane, so we end up
+        // with the characters for bytes [0-7, 16-23] and [8-15, 24-31]
+        __m256i chars_0 = _mm256_unpacklo_epi8(high, low);
+        __m256i chars_1 = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i*)&output[0],  _mm256_permute2x128_si256(chars_0, chars_1, 0x20));
+        _mm256_storeu_si256((__m256i*)&output[32], _mm256_permute2x128_si256(chars_0, chars_1, 0x31));
+    }
+
+    hex_encode_ssse3(output, input, input_len);
+}
+
+static bool has_ssse3() {
+    return __builtin_cpu_supports("ssse3");
+}
+
+static bool has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+#ifdef HEX_NEON
+
+static inline uint8x16_t neon_nibbles(uint8x16_t chars, uint8x16_t* valid) {
+    uint8x16_t digit = vsubq_u8(chars, vdupq_n_u8('0'));
+    uint8x16_t alpha = vsubq_u8(vorrq_u8(chars, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_digit = vcltq_u8(digit, vdupq_n_u8(10));
+    uint8x16_t is_alpha = vcltq_u8(alpha, vdupq_n_u8(6));
+    *valid = vandq_u8(*valid, vorrq_u8(is_digit, is_alpha));
+    return vorrq_u8(
+        vandq_u8(is_digit, digit),
+        vandq_u8(is_alpha, vaddq_u8(alpha, vdupq_n_u8(10)))
+    );
+}
+
+// NEON: 32 characters -> 16 bytes per iteration. vld2q splits the
+// characters into the high and low nibble characters for us.
+static bool hex_decode_neon(uint8_t* output, const char* input, int output_len) {
+    for (; output_len >= 16; output_len -= 16, input += 32, output += 16) {
+        uint8x16x2_t chars = vld2q_u8((const uint8_t*)input);
+        uint8x16_t valid = vdupq_n_u8(0xFF);
+        uint8x16_t high = neon_nibbles(chars.val[0], &valid);
+        uint8x16_t low  = neon_nibbles(chars.val[1], &valid);
+        if (vminvq_u8(valid) != 0xFF) return false;
+        vst1q_u8(output, vorrq_u8(vshlq_n_u8(high, 4), low));
+    }
+
+    return hex_decode_scalar(output, input, output_len);
+}
+
+// NEON: 16 bytes -> 32 characters per iteration
+static void hex_encode_neon(char* output, const uint8_t* input, int input_len) {
+    const uint8x16_t lookup = vld1q_u8((const uint8_t*)hex_lookup);
+
+    for (; input_len >= 16; input_len -= 16, input += 16, output += 32) {
+        uint8x16_t bytes = vld1q_u8(input);
+        uint8x16x2_t chars;
+        chars.val[0] = vqtbl1q_u8(lookup, vshrq_n_u8(bytes, 4));
+        chars.val[1] = vqtbl1q_u8(lookup, vandq_u8(bytes, vdupq_n_u8(0x0F)));
+        vst2q_u8((uint8_t*)output, chars);
+    }
+
+    hex_encode_scalar(output, input, input_len);
+}
+
+static bool has_neon() {
+    return true; // Always there on arm64
+}
+
+#endif
+
+#ifdef HEX_WASM_SIMD
+
+static inline v128_t wasm_nibbles(v128_t chars, v128_t* valid) {
+    v128_t digit = wasm_i8x16_sub(chars, wasm_i8x16_splat('0'));
+    v128_t alpha = wasm_i8x16_sub(wasm_v128_or(chars, wasm_i8x16_splat(0x20)), wasm_i8x16_splat('a'));
+    v128_t is_digit = wasm_u8x16_lt(digit, wasm_i8x16_splat(10));
+    v128_t is_alpha = wasm_u8x16_lt(alpha, wasm_i8x16_splat(6));
+    *valid = wasm_v128_and(*valid, wasm_v128_or(is_digit, is_alpha));
+    return wasm_v128_or(
+        wasm_v128_and(is_digit, digit),
+        wasm_v128_and(is_alpha, wasm_i8x16_add(alpha, wasm_i8x16_splat(10)))
+    );
+}
+
+// WebAssembly SIMD: 32 characters -> 16 bytes per iteration (only
+// compiled in when building with -msimd128)
+static bool hex_decode_wasm_simd(uint8_t* output, const char* input, int output_len) {
+    for (; output_len >= 16; output_len -= 16, input += 32, output += 16) {
+        v128_t chars_0 = wasm_v128_load(&input[0]);
+        v128_t chars_1 = wasm_v128_load(&input[16]);
+        v128_t high = wasm_i8x16_shuffle(chars_0, chars_1, 0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+        v128_t low  = wasm_i8x16_shuffle(chars_0, chars_1, 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+
+        v128_t valid = wasm_i8x16_splat(-1);
+        high = wasm_nibbles(high, &valid);
+        low  = wasm_nibbles(low, &valid);
+        if (!wasm_i8x16_all_true(valid)) return false;
+        wasm_v128_store(output, wasm_v128_or(wasm_i8x16_shl(high, 4), low));
+    }
+
+    return hex_decode_scalar(output, input, output_len);
+}
+
+// WebAssembly SIMD: 16 bytes -> 32 characters per iteration
+static void hex_encode_wasm_simd(char* output, const uint8_t* input, int input_len) {
+    const v128_t lookup = wasm_v128_load(hex_lookup);
+    const v128_t mask = wasm_i8x16_splat(0x0F);
+
+    for (; input_len >= 16; input_len -= 16, input += 16, output += 32) {
+        v128_t bytes = wasm_v128_load(input);
+        v128_t high = wasm_i8x16_swizzle(lookup, wasm_u8x16_shr(bytes, 4));
+        v128_t low  = wasm_i8x16_swizzle(lookup, wasm_v128_and(bytes, mask));
+        wasm_v128_store(&output[0],  wasm_i8x16_shuffle(high, low, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23));
+        wasm_v128_store(&output[16], wasm_i8x16_shuffle(high, low, 8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31));
+    }
+
+    hex_encode_scalar(output, input, input_len);
+}
+
+static bool has_wasm_simd() {
+    return true; // Compiled in means it's there, wasm has no runtime detection
+}
+
+#endif
+
+static bool has_scalar() {
+    return true;
+}
+
+struct HexImpl {
+    const char* name;
+    bool (*supported)();
+    bool (*decode)(uint8_t* output, const char* input, int output_len);
+    void (*encode)(char* output, const uint8_t* input, int input_len);
+};
+
+// In order of preference, the first supported one gets used
+static const HexImpl hex_impls[] = {
+#ifdef HEX_X86
+    { "avx2",      has_avx2,      hex_decode_avx2,      hex_encode_avx2 },
+    { "ssse3",     has_ssse3,     hex_decode_ssse3,     hex_encode_ssse3 },
+#endif
+#ifdef HEX_NEON
+    { "neon",      has_neon,      hex_decode_neon,      hex_encode_neon },
+#endif
+#ifdef HEX_WASM_SIMD
+    { "wasm_simd", has_wasm_simd, hex_decode_wasm_simd, hex_encode_wasm_simd },
+#endif
+    { "scalar",    has_scalar,    hex_decode_scalar,    hex_encode_scalar },
+};
+
+static const HexImpl* select_impl() {
+    for (auto& impl : hex_impls) {
+        if (impl.supported()) return &impl;
+    }
+    return NULL;
+}
+
+static const HexImpl* get_impl() {
+    static const HexImpl* impl = select_impl();
+    return impl;
+}
+
+bool hex_decode(uint8_t* output, const char* input, int output_len) {
+    return get_impl()->decode(output, input, output_len);
+}
+
+void hex_encode(char* output, const uint8_t* input, int input_len) {
+    get_impl()->encode(output, input, input_len);
+}
+
+#ifdef PRIVAVIDA_BENCHMARKS
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+void hex_benchmark() {
+
+    // Mostly ids, pubkeys and signatures, as that's what we spend our
+    // time on (e.g. the p tags of a big contact list)
+    const int SIZES[] = { 32, 64, 4096 };
+    const int ITERATIONS = 1000000;
+    const int MAX_SIZE = 4096;
+
+    static uint8_t bytes[MAX_SIZE], bytes_decoded[MAX_SIZE];
+    static char chars[2 * MAX_SIZE], chars_expected[2 * MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; ++i) {
+        bytes[i] = (uint8_t)(i * 167 + 13);
+    }
+    hex_encode_scalar(chars_expected, bytes, MAX_SIZE);
+
+    for (auto& impl : hex_impls) {
+        if (!impl.supported()) continue;
+
+        // Check it against the scalar version first, including
+        // uppercase and invalid characters
+        impl.encode(chars, bytes, MAX_SIZE);
+        bool ok = memcmp(chars, chars_expected, sizeof(chars)) == 0;
+        ok = ok && impl.decode(bytes_decoded, chars, MAX_SIZE);
+        ok = ok && memcmp(bytes, bytes_decoded, MAX_SIZE) == 0;
+        for (int i = 0; i < 2 * MAX_SIZE; ++i) {
+            if (chars[i] >= 'a') chars[i] -= 'a' - 'A';
+        }
+        ok = ok && impl.decode(bytes_decoded, chars, MAX_SIZE);
+        ok = ok && memcmp(bytes, bytes_decoded, MAX_SIZE) == 0;
+        for (int i = 0; ok && i < 256; ++i) {
+            if (i < 128 && hex_lookup_rev[i] != -1) continue;
+            memcpy(chars, chars_expected, 2 * 64);
+            chars[(i * 7) % 128] = (char)i;
+            ok = !impl.decode(bytes_decoded, chars, 64);
+        }
+        if (!ok) {
+            printf("hex %s: FAILED\n", impl.name);
+            continue;
+        }
+
+        for (int size : SIZES) {
+            int iterations = ITERATIONS / (size / 32);
+
+            auto start_time = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                impl.encode(chars, bytes, size);
+                __asm__ __volatile__("" : : "r"(chars) : "memory");
+            }
+            auto mid_time = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) {
+                impl.decode(bytes_decoded, chars_expected, size);
+                __asm__ __volatile__("" : : "r"(bytes_decoded) : "memory");
+            }
+            auto end_time = std::chrono::steady_clock::now();
+
+            double total_mb = (double)size * iterations / (1024 * 1024);
+            double encode_seconds = std::chrono::duration<double>(mid_time - start_time).count();
+            double decode_seconds = std::chrono::duration<double>(end_time - mid_time).count();
+            printf("hex %s (%d bytes): encode %.0f MB/s, decode %.0f MB/s\n",
+                   impl.name, size, total_mb / encode_seconds, total_mb / decode_seconds);
+        }
+    }
+}
+#endif
@@ -11,5 +11,14 @@
 extern const char hex_lookup[16];
 extern const int8_t hex_lookup_rev[128];
 
+// Both of these use SIMD instructions where the CPU has them (picked at
+// runtime). hex_decode always reads exactly 2*output_len characters, so
+// the caller needs to have checked the length of the input.
 bool hex_decode(uint8_t* output, const char* input, int output_len);
 void hex_encode(char* output, const uint8_t* input, int input_len);
+
+#ifdef PRIVAVIDA_BENCHMARKS
+// Checks each of the implementations the CPU supports against the scalar
+// version and prints their throughput
+void hex_benchmark();
+#endif
@@ -29,3 +29,10 @@ bool get_public_key(const Seckey* seckey, Pubkey* pubkey_out) {
     secp256k1_xonly_pubkey_serialize(secp256k1_context, pubkey_out->data, &xonly_pubkey);
     return true;
 }
+
+void secure_zero(void* data, size_t len) {
+    volatile uint8_t* ptr = (volatile uint8_t*)data;
+    while (len--) {
+        *ptr++ = 0;
+    }
+}
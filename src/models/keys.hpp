@@ -7,6 +7,7 @@
 
 #pragma once
 #include <inttypes.h>
+#include <stddef.h>
 
 struct EventId {
     uint8_t data[32];
@@ -49,3 +50,7 @@ static inline bool compare_keys(const Pubkey* a, const Pubkey* b) {
 }
 
 bool get_public_key(const Seckey* seckey, Pubkey* pubkey);
+
+// Zeroes memory that held secrets, in a way the compiler can't optimise
+// away (as it could a memset right before the memory goes out of scope)
+void secure_zero(void* data, size_t len);
@@ -7,6 +7,9 @@
 
 #include "nip04.hpp"
 #include "hex.hpp"
+#include "shared_secrets.hpp"
+#include "aes_cbc.hpp"
+#include "base64.hpp"
 
 #include <string.h>
 #include <stdio.h>
@@ -15,8 +18,6 @@
 extern "C" {
 #include <secp256k1_schnorrsig.h>
 #include <secp256k1_ecdh.h>
-#include "c/aes.h"
-#include "c/base64.h"
 #include "c/sha256.h"
 }
 
@@ -32,6 +33,12 @@ static uint32_t length_without_pkcs_padding(const uint8_t* data, uint32_t len);
 
 static bool compute_shared_secret(const Pubkey* pubkey, const Seckey* seckey, uint8_t* shared_secret) {
 
+    // A conversation always uses the same shared secret, so we only
+    // need to do the ECDH once per counterparty
+    if (shared_secrets_get(seckey, pubkey, shared_secret)) {
+        return true;
+    }
+
     static auto secp256k1_context = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 
     // Create pubkey with fixed y coordinate of 2
@@ -50,6 +57,7 @@ static bool compute_shared_secret(const Pubkey* pubkey, const Seckey* seckey, ui
         return false;
     }
 
+    shared_secrets_insert(seckey, pubkey, shared_secret);
     return true;
 }
 
@@ -57,6 +65,10 @@ bool nip04_decrypt(const Pubkey* pubkey, const Seckey* seckey, const char* ciphe
 
     static auto secp256k1_context = secp256k1_context_create(SECP256K1_CONTEXT_VERIFY);
 
+    if (len == 0) {
+        return false;
+    }
+
     // Step 1. Decode the content
     uint8_t payload[len], iv[AES_BLOCKLEN];
     uint32_t payload_len;
@@ -71,9 +83,8 @@ bool nip04_decrypt(const Pubkey* pubkey, const Seckey* seckey, const char* ciphe
     }
 
     // Step 3. Decrypt
-    AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, shared_secret, iv);
-    AES_CBC_decrypt_buffer(&ctx, payload, payload_len);
+    aes_cbc_decrypt(shared_secret, iv, payload, payload_len);
+    secure_zero(shared_secret, sizeof(shared_secret));
 
     // Step 4. Check & copy result
     payload_len = length_without_pkcs_padding(payload, payload_len);
@@ -122,49 +133,43 @@ bool nip04_encrypt(const Pubkey* pubkey, const Seckey* seckey, const char* plain
     }
 
     // Step 4. Encrypt
-    AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, shared_secret, iv);
-    AES_CBC_encrypt_buffer(&ctx, payload, payload_len);
+    aes_cbc_encrypt(shared_secret, iv, payload, payload_len);
+    secure_zero(shared_secret, sizeof(shared_secret));
 
     // Step 5. Encode the result
     char* ch = ciphertext_out;
-    ch += Base64encode(ch, payload, payload_len) - 1;
-    strncpy(ch, "?iv=", 4);
+    ch += base64_encode(ch, payload, payload_len);
+    memcpy(ch, "?iv=", 4);
     ch += 4;
-    ch += Base64encode(ch, iv, sizeof(iv)) - 1;
+    ch += base64_encode(ch, iv, sizeof(iv));
+    *ch = '\0';
     *len_out = (uint32_t)(ch - ciphertext_out);
     return true;
 }
 
 bool decode_content(const char* ciphertext, uint32_t len, uint8_t* payload, uint32_t* payload_len, uint8_t* iv) {
 
-    // Find "?iv=" string
-    int buffer_end_idx = -1;
-    int iv_start_idx = -1;
-    for (int i = 0; i + 4 < len; ++i) {
-        if (strncmp(&ciphertext[i], "?iv=", 4) == 0) {
-            buffer_end_idx = i;
-            iv_start_idx = i + 4;
-            break;
-        }
+    // The content is "<base64 payload>?iv=<base64 iv>". '?' can't appear
+    // in base64, so the first one has to be the separator.
+    auto separator = (const char*)memchr(ciphertext, '?', len);
+    if (!separator || separator + 4 > ciphertext + len || memcmp(separator, "?iv=", 4) != 0) {
+        return false;
     }
-    if (buffer_end_idx == -1) return false;
-
-    // Make a copy of the ciphertext so we can insert NULL-terminals
-    char temp[len + 1];
-    memcpy(temp, ciphertext, len);
-    temp[buffer_end_idx] = '\0';
-    temp[len] = '\0';
-
-    // Decode payload
-    *payload_len = Base64decode(payload, temp);
-
-    // Decode iv (into temp first, to be safe)
-    auto iv_len = Base64decode((uint8_t*)temp, &ciphertext[iv_start_idx]);
-    if (iv_len != AES_BLOCKLEN) return false;
-
-    // Copy iv to output
-    memcpy(iv, (uint8_t*)temp, iv_len);
+    auto payload_chars_len = (int)(separator - ciphertext);
+    auto iv_chars = separator + 4;
+    auto iv_chars_len = (int)(ciphertext + len - iv_chars);
+
+    // Decode the payload straight into the caller's buffer (which has room
+    // for len bytes, more than the payload can decode to)
+    int decoded_len = base64_decode(payload, ciphertext, payload_chars_len);
+    if (decoded_len <= 0 || decoded_len % AES_BLOCKLEN != 0) return false;
+    *payload_len = (uint32_t)decoded_len;
+
+    // Decode the iv
+    uint8_t iv_decoded[base64_decoded_len_max(24)];
+    if (iv_chars_len > 24) return false;
+    if (base64_decode(iv_decoded, iv_chars, iv_chars_len) != AES_BLOCKLEN) return false;
+    memcpy(iv, iv_decoded, AES_BLOCKLEN);
 
     return true;
 }
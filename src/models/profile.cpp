@@ -215,6 +215,7 @@ bool parse_profile_data(Profile* profile, const Event* event) {
     profile->__header__ = (Profile::VERSION << 24) | (uint32_t)total_size;
     profile->pubkey = event->pubkey;
     profile->event_id = event->id;
+    profile->created_at = event->created_at;
 
     ProfileReader handler;
     handler.buffer_ptr = profile->__buffer;
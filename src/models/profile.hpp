@@ -24,13 +24,14 @@
 /// Profile
 //
 struct Profile {
-    static const uint8_t VERSION = 0x01;
+    static const uint8_t VERSION = 0x02;
 
     // Profile header (contains version number & size)
     uint32_t __header__;
 
     Pubkey  pubkey;
     EventId event_id;
+    uint64_t created_at; // Of the event, newer profiles replace older ones
 
     // Profile properties
     RelString name;
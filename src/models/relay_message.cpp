@@ -6,17 +6,13 @@
 //
 
 #include "relay_message.hpp"
+#include "event_reader.hpp"
 #include "hex.hpp"
 
 #include <string.h>
 #include <stdlib.h>
 #include <rapidjson/reader.h>
 
-static inline size_t max(size_t a, size_t b) {
-    return a < b ? b : a;
-}
-
-
 // Message formats
 // ["AUTH", <challenge-string>]
 // ["CLOSE", <subscription_id>]
@@ -43,6 +39,7 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
         STATE_AT_NOTICE_MESSAGE,
         STATE_AT_EVENT_SUBSCRIPTION_ID,
         STATE_AT_EVENT,
+        STATE_IN_EVENT,
         STATE_ENDED
     };
 
@@ -50,6 +47,17 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
     RelayMessage* result;
     StackBuffer* stack_buffer;
 
+    // Once we get to the event object of an EVENT message, all tokens
+    // get passed on to the event reader until the event ends
+    EventReader* event_reader;
+    size_t input_len;
+    bool event(bool ok) {
+        if (event_reader->state == EventReader::STATE_ENDED) {
+            return stop();
+        }
+        return ok;
+    }
+
     bool stop() {
         state = STATE_ENDED;
         return false;
@@ -63,9 +71,11 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
     }
 
     bool Null() {
+        if (state == STATE_IN_EVENT) return event(event_reader->Null());
         return error();
     }
     bool Bool(bool b) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Bool(b));
         if (state == STATE_AT_OK_BOOLEAN) {
             result->ok.ok = b;
             return next(STATE_AT_OK_MESSAGE);
@@ -73,15 +83,19 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
         return error();
     }
     bool Int(int i) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Int(i));
         return (i >= 0) ? Uint64(i) : error();
     }
     bool Uint(unsigned u) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Uint(u));
         return Uint64(u);
     }
     bool Int64(int64_t i) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Int64(i));
         return (i >= 0) ? Uint64(i) : error();
     }
     bool Uint64(uint64_t u) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Uint64(u));
         if (state == STATE_AT_COUNT) {
             result->count.count = u;
             return stop();
@@ -89,9 +103,11 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
         return error();
     }
     bool Double(double d) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Double(d));
         return false;
     }
     bool String(const char* str, rapidjson::SizeType length, bool copy) {
+        if (state == STATE_IN_EVENT) return event(event_reader->String(str, length, copy));
         if (state == STATE_AT_MESSAGE_TYPE) {
             if (strncmp("AUTH", str, length) == 0) {
                 result->type = RelayMessage::AUTH;
@@ -159,14 +175,18 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
         return error();
     }
     bool StartObject() {
+        if (state == STATE_IN_EVENT) return event(event_reader->StartObject());
         if (state == STATE_AT_COUNT_OBJECT) {
             return next(STATE_IN_COUNT_OBJECT);
         } else if (state == STATE_AT_EVENT) {
-            return stop();
+            state = STATE_IN_EVENT;
+            event_reader->start(input_len);
+            return event(event_reader->StartObject());
         }
         return error();
     }
     bool Key(const char* str, rapidjson::SizeType length, bool copy) {
+        if (state == STATE_IN_EVENT) return event(event_reader->Key(str, length, copy));
         if (state == STATE_IN_COUNT_OBJECT &&
             strncmp("count", str, length) == 0) {
             return next(STATE_AT_COUNT);
@@ -174,41 +194,147 @@ struct RelayMessageReader : public rapidjson::BaseReaderHandler<rapidjson::UTF8<
         return error();
     }
     bool EndObject(rapidjson::SizeType memberCount) {
+        if (state == STATE_IN_EVENT) return event(event_reader->EndObject(memberCount));
         return error();
     }
     bool StartArray() {
+        if (state == STATE_IN_EVENT) return event(event_reader->StartArray());
         if (state == STATE_STARTED) {
             return next(STATE_AT_MESSAGE_TYPE);
         }
         return error();
     }
     bool EndArray(rapidjson::SizeType elementCount) {
+        if (state == STATE_IN_EVENT) return event(event_reader->EndArray(elementCount));
         return error();
     }
 };
 
-bool relay_message_parse(const char* input, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result) {
+template <unsigned parse_flags, typename InputStream>
+static bool parse(InputStream& stream, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result) {
+
+    // The event (if this is an EVENT message) is built straight on the heap
+    StackBuffer event_buffer(NULL, 0);
+    EventReader event_reader(&event_buffer);
 
     RelayMessageReader handler;
     handler.result = result;
     handler.stack_buffer = stack_buffer;
+    handler.event_reader = &event_reader;
+    handler.input_len = input_len;
 
-    auto stack_size = max(input_len, 512);
-    char stack_memory[stack_size];
-    rapidjson::MemoryPoolAllocator<> allocator(stack_memory, stack_size);
+    // rapidjson needs some scratch memory (for unescaping strings), it
+    // allocates any more than this on the heap
+    char allocator_memory[4096];
+    rapidjson::MemoryPoolAllocator<> allocator(allocator_memory, sizeof(allocator_memory));
     rapidjson::GenericReader<rapidjson::UTF8<>, rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<>> reader(&allocator);
 
-    rapidjson::StringStream stream(input);
-    reader.Parse(stream, handler);
+    reader.template Parse<parse_flags>(stream, handler);
+
+    if (handler.state == RelayMessageReader::STATE_IN_EVENT) {
+        // The event is invalid, but the message itself was fine
+        result->event.event = NULL;
+        result->event.err = event_reader.err ? event_reader.err : PARSE_ERR_INVALID_JSON;
+        return true;
+    }
 
     if (reader.HasParseError() && handler.state != RelayMessageReader::STATE_ENDED) {
         return false;
     }
 
     if (result->type == RelayMessage::EVENT) {
-        result->event.input = &input[stream.Tell() - 1];
-        result->event.input_len = input_len - (stream.Tell() - 1);
+        auto event = event_reader.finish();
+        if (event) {
+            auto size = Event::size_of(event);
+            result->event.event = (Event*)realloc(event_buffer.copy_out(size), size);
+            result->event.err = PARSE_NO_ERR;
+        } else {
+            result->event.event = NULL;
+            result->event.err = event_reader.err;
+        }
     }
 
     return true;
 }
+
+bool relay_message_parse(const char* input, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result) {
+    rapidjson::StringStream stream(input);
+    return parse<rapidjson::kParseDefaultFlags>(stream, input_len, stack_buffer, result);
+}
+
+bool relay_message_parse_insitu(char* input, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result) {
+    rapidjson::InsituStringStream stream(input);
+    return parse<rapidjson::kParseInsituFlag>(stream, input_len, stack_buffer, result);
+}
+
+#ifdef PRIVAVIDA_BENCHMARKS
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include <string>
+
+void relay_message_benchmark(const char* file_name) {
+    FILE* file = fopen(file_name, "rb");
+    if (!file) {
+        printf("Failed to open file: '%s'\n", file_name);
+        return;
+    }
+
+    std::vector<std::string> frames;
+    size_t total_bytes = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, file)) > 0) {
+        if (line[line_len - 1] == '\n') line_len--;
+        if (line_len == 0) continue;
+        frames.emplace_back(line, line_len);
+        total_bytes += line_len;
+    }
+    free(line);
+    fclose(file);
+
+    if (frames.empty()) {
+        printf("No relay messages in '%s'\n", file_name);
+        return;
+    }
+
+    const int ITERATIONS = 20;
+    StackBufferFixed<1024> stack_buffer;
+    std::string scratch;
+
+    for (int insitu = 0; insitu < 2; ++insitu) {
+        int num_failed = 0;
+        auto start_time = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < ITERATIONS; ++i) {
+            for (auto& frame : frames) {
+                RelayMessage message;
+                bool ok;
+                if (insitu) {
+                    // The in-situ parser trashes its input, so it gets a
+                    // fresh copy each time (just like the platform buffer)
+                    scratch = frame;
+                    ok = relay_message_parse_insitu(&scratch[0], scratch.size(), &stack_buffer, &message);
+                } else {
+                    ok = relay_message_parse(frame.c_str(), frame.size(), &stack_buffer, &message);
+                }
+                if (!ok) {
+                    num_failed++;
+                } else if (message.type == RelayMessage::EVENT) {
+                    free(message.event.event);
+                }
+            }
+        }
+
+        auto end_time = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end_time - start_time).count();
+        double num_messages = (double)frames.size() * ITERATIONS;
+        printf("relay_message_parse%s: %.0f messages/s, %.1f MB/s (%d failed)\n",
+               insitu ? "_insitu" : "",
+               num_messages / seconds,
+               (double)total_bytes * ITERATIONS / seconds / (1024 * 1024),
+               num_failed / ITERATIONS);
+    }
+}
+#endif
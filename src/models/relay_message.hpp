@@ -8,6 +8,7 @@
 #pragma once
 
 #include "event.hpp"
+#include "event_parse.hpp"
 #include "../utils/stackbuffer.hpp"
 #include <string>
 
@@ -36,8 +37,8 @@ struct RelayMessage {
     };
     struct RelayMessageEvent {
         char subscription_id[SUB_ID_MAX_LEN];
-        const char* input;
-        size_t input_len;
+        Event* event;   // Heap-allocated and owned by the caller (NULL if the event is invalid)
+        ParseError err; // Why the event is invalid
     };
     struct RelayMessageNotice {
         const char* message;
@@ -59,4 +60,18 @@ struct RelayMessage {
     };
 };
 
+// Parses a relay message. For EVENT messages the event is parsed in the
+// same pass, straight into a heap-allocated Event of exactly the right size.
 bool relay_message_parse(const char* input, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result);
+
+// Same as relay_message_parse, but strings are unescaped in place in the
+// (NUL terminated) input rather than in scratch memory, so the content and
+// tags of an event get copied exactly once. The input is garbage afterwards.
+bool relay_message_parse_insitu(char* input, size_t input_len, StackBuffer* stack_buffer, RelayMessage* result);
+
+#ifdef PRIVAVIDA_BENCHMARKS
+// Parses each line of a file of captured relay messages (as written by
+// the network layer in benchmark builds) with both parsers, printing the
+// throughput of each.
+void relay_message_benchmark(const char* file_name);
+#endif
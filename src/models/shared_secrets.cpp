@@ -0,0 +1,116 @@
+//
+//  shared_secrets.cpp
+//  privavida-core
+//
+
+#include "shared_secrets.hpp"
+#include "../utils/key_table.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <mutex>
+
+struct SharedSecret {
+    Pubkey pubkey;
+    uint8_t secret[32];
+};
+
+// Everything secret is in here, allocated on its own pages
+struct SecretStorage {
+    Seckey seckey;
+    SharedSecret entries[SHARED_SECRETS_CAPACITY];
+};
+
+// The entries are used as a ring buffer (in insertion order), with a
+// KeyTable from pubkey to ring index on the side for lookups. The table
+// only holds pubkeys, so it can live in ordinary memory.
+static SecretStorage* storage = NULL;
+static bool has_seckey = false;
+static uint32_t entries_size = 0;
+static uint32_t entries_head = 0; // Index of the oldest entry once the ring is full
+static KeyTable<Pubkey, uint32_t> entries_by_pubkey;
+static std::mutex entries_mutex;
+
+static bool allocate_storage() {
+    if (storage) return true;
+
+    void* data = mmap(NULL, sizeof(SecretStorage), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        printf("Failed to allocate shared secrets storage\n");
+        return false;
+    }
+
+    // If we can't lock the pages (e.g. we're over RLIMIT_MEMLOCK) we
+    // still use them, we just lose the guarantee they stay out of swap
+    if (mlock(data, sizeof(SecretStorage)) != 0) {
+        printf("Failed to lock shared secrets storage\n");
+    }
+#ifdef MADV_DONTDUMP
+    madvise(data, sizeof(SecretStorage), MADV_DONTDUMP);
+#endif
+
+    storage = (SecretStorage*)data;
+    return true;
+}
+
+static void clear() {
+    if (storage) {
+        secure_zero(storage, sizeof(SecretStorage));
+    }
+    has_seckey = false;
+    entries_size = 0;
+    entries_head = 0;
+    entries_by_pubkey.clear();
+}
+
+static bool is_current_seckey(const Seckey* seckey) {
+    return has_seckey && memcmp(storage->seckey.data, seckey->data, sizeof(Seckey)) == 0;
+}
+
+bool shared_secrets_get(const Seckey* seckey, const Pubkey* pubkey, uint8_t* shared_secret_out) {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    if (!is_current_seckey(seckey)) return false;
+
+    auto index = entries_by_pubkey.find(pubkey);
+    if (!index) return false;
+
+    memcpy(shared_secret_out, storage->entries[*index].secret, 32);
+    return true;
+}
+
+void shared_secrets_insert(const Seckey* seckey, const Pubkey* pubkey, const uint8_t* shared_secret) {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    if (!allocate_storage()) return;
+
+    if (!is_current_seckey(seckey)) {
+        clear();
+        storage->seckey = *seckey;
+        has_seckey = true;
+    }
+
+    auto index = entries_by_pubkey.find(pubkey);
+    if (index) {
+        memcpy(storage->entries[*index].secret, shared_secret, 32);
+        return;
+    }
+
+    uint32_t index_new;
+    if (entries_size < SHARED_SECRETS_CAPACITY) {
+        index_new = entries_size++;
+    } else {
+        index_new = entries_head;
+        entries_by_pubkey.erase(&storage->entries[index_new].pubkey);
+        secure_zero(&storage->entries[index_new], sizeof(SharedSecret));
+        entries_head = (entries_head + 1) % SHARED_SECRETS_CAPACITY;
+    }
+
+    storage->entries[index_new].pubkey = *pubkey;
+    memcpy(storage->entries[index_new].secret, shared_secret, 32);
+    entries_by_pubkey.insert(pubkey, index_new);
+}
+
+void shared_secrets_clear() {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    clear();
+}
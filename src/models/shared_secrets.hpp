@@ -0,0 +1,27 @@
+//
+//  shared_secrets.hpp
+//  privavida-core
+//
+
+#pragma once
+#include "keys.hpp"
+
+// The shared secrets cache remembers the NIP-04 shared secret (the ECDH
+// x coordinate) we've derived for each counterparty, so a conversation
+// only needs one ECDH no matter how many messages it has.
+//
+// The secrets (and the seckey they were derived from) live in a single
+// block of memory that is locked into RAM (so it never gets swapped out)
+// and zeroed whenever entries are evicted or the cache is cleared. The
+// cache belongs to one seckey at a time: a lookup or insert with another
+// seckey clears it first, but it should also be cleared explicitly when
+// the account changes.
+//
+// Messages are decrypted on the worker threads, so all of these
+// functions are thread-safe.
+
+constexpr uint32_t SHARED_SECRETS_CAPACITY = 256;
+
+bool shared_secrets_get(const Seckey* seckey, const Pubkey* pubkey, uint8_t* shared_secret_out);
+void shared_secrets_insert(const Seckey* seckey, const Pubkey* pubkey, const uint8_t* shared_secret);
+void shared_secrets_clear();
@@ -0,0 +1,75 @@
+//
+//  verified_ids.cpp
+//  privavida-core
+//
+
+#include "verified_ids.hpp"
+#include "../utils/key_table.hpp"
+#include <vector>
+#include <mutex>
+
+// The entries are kept in a ring buffer (in insertion order), with a
+// KeyTable from id to ring index on the side for lookups
+static std::vector<VerifiedId> entries;
+static uint32_t entries_head = 0; // Index of the oldest entry once the ring is full
+static KeyTable<EventId, uint32_t> entries_by_id;
+static uint64_t insert_count = 0;
+static std::mutex entries_mutex;
+
+bool verified_ids_contains(const EventId* id, const Signature* sig) {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    auto index = entries_by_id.find(id);
+    return index && memcmp(entries[*index].sig.data, sig->data, sizeof(Signature)) == 0;
+}
+
+void verified_ids_insert(const EventId* id, const Signature* sig) {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    auto index = entries_by_id.find(id);
+    if (index) {
+        entries[*index].sig = *sig;
+        return;
+    }
+
+    uint32_t index_new;
+    if (entries.size() < VERIFIED_IDS_CAPACITY) {
+        if (entries.empty()) {
+            entries.reserve(VERIFIED_IDS_CAPACITY);
+            entries_by_id.reserve(VERIFIED_IDS_CAPACITY);
+        }
+        index_new = (uint32_t)entries.size();
+        entries.push_back(VerifiedId());
+    } else {
+        index_new = entries_head;
+        entries_by_id.erase(&entries[index_new].id);
+        entries_head = (entries_head + 1) % VERIFIED_IDS_CAPACITY;
+    }
+
+    entries[index_new].id = *id;
+    entries[index_new].sig = *sig;
+    entries_by_id.insert(id, index_new);
+    insert_count++;
+}
+
+void verified_ids_clear() {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    entries.clear();
+    entries_head = 0;
+    entries_by_id.clear();
+}
+
+uint32_t verified_ids_count() {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    return (uint32_t)entries.size();
+}
+
+bool verified_ids_get(uint32_t i, VerifiedId* entry_out) {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    if (i >= entries.size()) return false;
+    *entry_out = entries[(entries_head + i) % entries.size()];
+    return true;
+}
+
+uint64_t verified_ids_insert_count() {
+    std::lock_guard<std::mutex> lock(entries_mutex);
+    return insert_count;
+}
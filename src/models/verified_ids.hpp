@@ -0,0 +1,37 @@
+//
+//  verified_ids.hpp
+//  privavida-core
+//
+
+#pragma once
+#include "keys.hpp"
+
+// The verified ids cache remembers the (id, sig) pairs of events whose
+// signature we've already checked. The id is the hash of everything the
+// signature covers, so if an event's recomputed hash matches its id and
+// the (id, sig) pair is in the cache, we can skip the (far more
+// expensive) Schnorr verification.
+//
+// The cache is bounded: once it holds VERIFIED_IDS_CAPACITY entries, the
+// oldest entries are evicted first. Events are verified on the worker
+// threads, so all of these functions are thread-safe.
+
+constexpr uint32_t VERIFIED_IDS_CAPACITY = 16384;
+
+struct VerifiedId {
+    EventId id;
+    Signature sig;
+};
+
+bool verified_ids_contains(const EventId* id, const Signature* sig);
+void verified_ids_insert(const EventId* id, const Signature* sig);
+void verified_ids_clear();
+
+// Returns the number of entries in the cache, and copies out the i'th
+// oldest entry (returning false if there isn't one)
+uint32_t verified_ids_count();
+bool verified_ids_get(uint32_t i, VerifiedId* entry_out);
+
+// Returns the number of entries ever inserted, which lets a caller that
+// persists the cache work out which entries it hasn't written yet
+uint64_t verified_ids_insert_count();
@@ -8,18 +8,39 @@
 #include "network.hpp"
 #include <app.hpp>
 #include <platform.h>
-#include "../models/event_parse.hpp"
 #include "../models/event_stringify.hpp"
 #include "../models/relay_message.hpp"
 #include "../models/client_message.hpp"
 #include "../models/hex.hpp"
 #include "../data_layer/events.hpp"
 #include "../data_layer/relays.hpp"
+#include "../utils/timer.hpp"
 #include <string.h>
+#include <stdlib.h>
 #include <memory>
+#include <chrono>
+#include <algorithm>
 
 constexpr int MAX_CONCURRENT_REQUESTS_PER_RELAY = 3;
 
+// Tasks that start at the same time on the same relay share a single
+// subscription (a REQ with several filters), as relays limit how many
+// subscriptions we can have open. Relays also limit the number of
+// filters in a REQ, and how big one can get, so tasks are only merged
+// while their filters hold MAX_FILTER_ITEMS_PER_SUBSCRIPTION ids,
+// authors, kinds and tags between them (a task with more goes alone).
+constexpr int MAX_FILTERS_PER_SUBSCRIPTION = 10;
+constexpr uint32_t MAX_FILTER_ITEMS_PER_SUBSCRIPTION = 400;
+
+// Dropped connections are reopened after a delay that doubles with each
+// failed attempt (up to a limit). The delay is jittered so that we don't
+// all hit a relay at the same time once it comes back.
+constexpr long RECONNECT_DELAY_MIN_MS = 1000;
+constexpr long RECONNECT_DELAY_MAX_MS = 60000;
+
+// The weight of each new sample in the latency averages
+constexpr double RELAY_STATS_ALPHA = 0.2;
+
 struct RelayTask {
 
     enum Type {
@@ -36,12 +57,20 @@ struct RelayTask {
         COMPLETED
     };
 
+    network::TaskId id;
     Type type;
     State state;
     RelayId relay_id;
-    char subscription_id[65];
+    char subscription_id[65]; // Shared by the tasks of a subscription
     std::unique_ptr<Filters> filters;
     std::unique_ptr<Event> event;
+    network::RequestCallback callback; // REQUEST only
+    network::StartCallback start_callback; // REQUEST only
+    bool exclusive; // REQUEST only, doesn't share its subscription
+    std::chrono::steady_clock::time_point start_time;
+    int64_t started_at; // Unix time the task (last) became ACTIVE
+    int64_t newest_created_at; // STREAM only, of the events it got (-1 if none)
+    bool got_event; // REQUEST only
 };
 
 struct RelayConnection {
@@ -56,12 +85,43 @@ struct RelayConnection {
     State state;
     AppWebsocketHandle socket;
     int32_t num_concurrent_requests;
+    int32_t num_failed_attempts; // Since the connection was last open
+    bool reconnect_scheduled;
+    network::RelayStats stats;
 };
 
 static std::vector<RelayConnection> connections;
 static std::vector<RelayTask> tasks;
 
 static void process_tasks();
+
+#ifdef PRIVAVIDA_BENCHMARKS
+// Captures the traffic for relay_message_benchmark. The file is kept open
+// and flushed once the messages settle down, rather than being opened
+// for every message.
+static FILE* capture_file = NULL;
+static bool capture_flush_scheduled = false;
+
+static void capture_message(const char* data, int data_length) {
+    if (!capture_file) {
+        capture_file = fopen(app::get_user_data_path("relay_traffic.txt"), "ab");
+        if (!capture_file) return;
+    }
+    fwrite(data, 1, data_length, capture_file);
+    fputc('\n', capture_file);
+
+    if (capture_flush_scheduled) return;
+    capture_flush_scheduled = true;
+    timer::set_timeout([]() {
+        capture_flush_scheduled = false;
+        fflush(capture_file);
+        app::user_data_flush();
+    }, 1000);
+}
+#endif
+
+static network::TaskId next_task_id = 1;
+
 static void generate_new_subscription_id(RelayTask* task) {
     static int next_sub_id = 0;
     memset(task->subscription_id, 0, sizeof(RelayTask::subscription_id));
@@ -91,8 +151,72 @@ static RelayConnection& get_or_create_connection_for_relay(int32_t relay_id) {
     new_conn.state = RelayConnection::CONNECTING;
     new_conn.socket = platform_websocket_open(relay_info->url.data.get(relay_info), NULL);
     new_conn.num_concurrent_requests = 0;
+    new_conn.num_failed_attempts = 0;
+    new_conn.reconnect_scheduled = false;
+    memset(&new_conn.stats, 0, sizeof(network::RelayStats));
     return new_conn;
 }
+
+static void add_sample(double* average, uint32_t num_samples_before, double sample) {
+    *average = num_samples_before ? *average + RELAY_STATS_ALPHA * (sample - *average) : sample;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - time).count();
+}
+
+static void reopen_connection(RelayId relay_id) {
+    auto conn = get_connection_for_relay(relay_id);
+    if (!conn) return;
+
+    auto relay_info = data_layer::get_relay_info(relay_id);
+    printf("Reconnecting: %s\n", relay_info->url.data.get(relay_info));
+
+    conn->reconnect_scheduled = false;
+    conn->state = RelayConnection::CONNECTING;
+    conn->socket = platform_websocket_open(relay_info->url.data.get(relay_info), NULL);
+}
+
+// Called when the connection closes or fails to open. Whatever was active
+// on the connection gets started over once it's back: REQUESTs haven't
+// had their EOSE (nor PUBLISHes their OK), and STREAMs are resubscribed
+// from the newest event they got, so we don't miss anything in between.
+static void connection_lost(RelayConnection* conn) {
+    if (conn->state != RelayConnection::CLOSED) {
+        conn->stats.num_errors++;
+    }
+    conn->state = RelayConnection::CLOSED;
+    conn->num_concurrent_requests = 0;
+
+    for (auto& task : tasks) {
+        if (task.relay_id != conn->relay_id || task.state != RelayTask::ACTIVE) continue;
+
+        if (task.type == RelayTask::STREAM) {
+            task.filters->since = task.newest_created_at != -1 ? task.newest_created_at : task.started_at;
+            task.filters->limit = -1;
+        }
+        if (task.type != RelayTask::PUBLISH) {
+            generate_new_subscription_id(&task);
+        }
+        task.got_event = false;
+        task.state = RelayTask::QUEUED;
+    }
+
+    if (conn->reconnect_scheduled) return;
+    conn->reconnect_scheduled = true;
+
+    long delay = RECONNECT_DELAY_MIN_MS << (conn->num_failed_attempts < 6 ? conn->num_failed_attempts : 6);
+    if (delay > RECONNECT_DELAY_MAX_MS) {
+        delay = RECONNECT_DELAY_MAX_MS;
+    }
+    delay = (long)(delay * (0.5 + (double)rand() / RAND_MAX)); // 50% to 150%
+    conn->num_failed_attempts++;
+
+    auto relay_id = conn->relay_id;
+    timer::set_timeout([relay_id]() {
+        reopen_connection(relay_id);
+    }, delay);
+}
 static RelayTask* get_task_for_subscription_id(const char* subscription_id) {
     for (auto& task : tasks) {
         if (strcmp(task.subscription_id, subscription_id) == 0) {
@@ -110,18 +234,77 @@ static RelayTask* get_task_for_event_id(const EventId* event_id) {
     return NULL;
 }
 
-void network::relay_add_task_request(RelayId relay_id, const Filters* filters) {
+static uint32_t filter_items(const Filters* filters) {
+    return filters->ids.size + filters->authors.size + filters->kinds.size + filters->e_tags.size + filters->p_tags.size;
+}
+
+// REQUEST tasks that are on their way to being started, which count
+// against the relay's concurrent requests limit like the active ones
+static int num_requests_starting(RelayId relay_id) {
+    int count = 0;
+    for (auto& task : tasks) {
+        if (task.type == RelayTask::REQUEST && task.relay_id == relay_id &&
+            (task.state == RelayTask::WAITING_FOR_CONNECTION || task.state == RelayTask::READY)) {
+            count++;
+        }
+    }
+    return count;
+}
+
+network::TaskId network::relay_add_task_request(RelayId relay_id, const Filters* filters, RequestCallback callback, bool exclusive, StartCallback start_callback) {
     auto filters_copy = (Filters*)malloc(Filters::size_of(filters));
     memcpy(filters_copy, filters, Filters::size_of(filters));
 
     tasks.push_back(RelayTask());
     auto& task = tasks.back();
+    task.id = next_task_id++;
     task.relay_id = relay_id;
     task.type = RelayTask::REQUEST;
     task.state = RelayTask::QUEUED;
     task.filters = std::unique_ptr<Filters>(filters_copy);
+    task.callback = std::move(callback);
+    task.start_callback = std::move(start_callback);
+    task.exclusive = exclusive;
+    task.newest_created_at = -1;
+    task.got_event = false;
     generate_new_subscription_id(&task);
 
+    auto task_id = task.id;
+    process_tasks();
+    return task_id;
+}
+
+void network::relay_cancel_task(TaskId task_id) {
+    RelayTask* task = NULL;
+    for (auto& other : tasks) {
+        if (other.id == task_id && other.state != RelayTask::COMPLETED) {
+            task = &other;
+        }
+    }
+    if (!task) return;
+
+    if (task->state == RelayTask::ACTIVE) {
+        bool shared = false;
+        for (auto& other : tasks) {
+            if (&other != task && other.state == RelayTask::ACTIVE && other.type == task->type &&
+                other.relay_id == task->relay_id && strcmp(other.subscription_id, task->subscription_id) == 0) {
+                shared = true;
+            }
+        }
+
+        auto conn = get_connection_for_relay(task->relay_id);
+        if (!shared && conn && conn->state == RelayConnection::OPEN) {
+            StackBufferFixed<64> req_buffer;
+            auto req = client_message_close(task->subscription_id, &req_buffer);
+            printf("Request: %s\n", req);
+            platform_websocket_send(conn->socket, req);
+            if (task->type == RelayTask::REQUEST) {
+                conn->num_concurrent_requests--;
+            }
+        }
+    }
+
+    task->state = RelayTask::COMPLETED;
     process_tasks();
 }
 
@@ -132,10 +315,13 @@ void network::relay_add_task_stream(RelayId relay_id, const Filters* filters) {
 
     tasks.push_back(RelayTask());
     auto& task = tasks.back();
+    task.id = next_task_id++;
     task.relay_id = relay_id;
     task.type = RelayTask::STREAM;
     task.state = RelayTask::QUEUED;
     task.filters = std::unique_ptr<Filters>(filters_copy);
+    task.exclusive = false;
+    task.newest_created_at = -1;
     generate_new_subscription_id(&task);
 
     process_tasks();
@@ -147,10 +333,12 @@ void network::relay_add_task_publish(RelayId relay_id, const Event* event) {
 
     tasks.push_back(RelayTask());
     auto& task = tasks.back();
+    task.id = next_task_id++;
     task.relay_id = relay_id;
     task.type = RelayTask::PUBLISH;
     task.state = RelayTask::QUEUED;
     task.event = std::unique_ptr<Event>(event_copy);
+    task.exclusive = false;
     task.subscription_id[0] = '\0';
 
     process_tasks();
@@ -164,6 +352,14 @@ void network::stop_all_tasks() {
             continue;
         }
 
+        // The other tasks of the subscription get closed along with it
+        for (auto& other : tasks) {
+            if (&other != &task && other.state == RelayTask::ACTIVE && other.type != RelayTask::PUBLISH &&
+                other.relay_id == task.relay_id && strcmp(other.subscription_id, task.subscription_id) == 0) {
+                other.state = RelayTask::COMPLETED;
+            }
+        }
+
         auto conn = get_connection_for_relay(task.relay_id);
         if (!conn) {
             continue;
@@ -198,7 +394,7 @@ void process_tasks() {
     //     bump them automatically to WAITING_FOR_CONNECTION.
     //     If the tasks are REQUEST events we want to only
     //     bump them when the relay is not at its concurrent
-    //     requests limit.
+    //     requests limit (counting the ones bumped already).
     for (auto& task : tasks) {
         if (task.state != RelayTask::QUEUED) continue;
 
@@ -210,7 +406,8 @@ void process_tasks() {
             }
             case RelayTask::REQUEST: {
                 auto conn = get_connection_for_relay(task.relay_id);
-                if (!conn || conn->num_concurrent_requests < MAX_CONCURRENT_REQUESTS_PER_RELAY) {
+                int num_requests = (conn ? conn->num_concurrent_requests : 0) + num_requests_starting(task.relay_id);
+                if (num_requests < MAX_CONCURRENT_REQUESTS_PER_RELAY) {
                     task.state = RelayTask::WAITING_FOR_CONNECTION;
                 }
                 break;
@@ -224,32 +421,62 @@ void process_tasks() {
     for (auto& task : tasks) {
         if (task.state != RelayTask::WAITING_FOR_CONNECTION) continue;
 
+        // (A CLOSED connection gets reopened by connection_lost())
         auto& conn = get_or_create_connection_for_relay(task.relay_id);
         if (conn.state == RelayConnection::OPEN) {
             task.state = RelayTask::READY;
-        } else if (conn.state == RelayConnection::CLOSED) {
-            auto relay_info = data_layer::get_relay_info(task.relay_id);
-            printf("WARNING: task has been created for relay %s, but the connection is CLOSED\n", relay_info->url.data.get(relay_info));
         }
     }
 
-    // For each READY task, start the task
-    for (auto& task : tasks) {
+    // For each READY task, start the task. READY REQUEST (or STREAM)
+    // tasks for the same relay are started together as one subscription,
+    // taking on the subscription id of the first one. The start
+    // callbacks of the REQUEST tasks are called once we're done here.
+    int64_t now = time(NULL);
+    std::vector<network::StartCallback> start_callbacks;
+    for (int i = 0; i < tasks.size(); ++i) {
+        auto& task = tasks[i];
         if (task.state != RelayTask::READY) continue;
 
         auto conn = get_connection_for_relay(task.relay_id);
         if (!conn || conn->state != RelayConnection::OPEN) continue;
 
+        const Filters* filters[MAX_FILTERS_PER_SUBSCRIPTION];
+        uint32_t num_filters = 0;
+        if (task.type != RelayTask::PUBLISH) {
+            filters[num_filters++] = task.filters.get();
+            uint32_t num_items = filter_items(task.filters.get());
+            for (int j = i + 1; j < tasks.size() && num_filters < MAX_FILTERS_PER_SUBSCRIPTION && !task.exclusive; ++j) {
+                auto& other = tasks[j];
+                if (other.state != RelayTask::READY || other.type != task.type || other.relay_id != task.relay_id ||
+                    other.exclusive || num_items + filter_items(other.filters.get()) > MAX_FILTER_ITEMS_PER_SUBSCRIPTION) continue;
+
+                num_items += filter_items(other.filters.get());
+                strcpy(other.subscription_id, task.subscription_id);
+                other.start_time = std::chrono::steady_clock::now();
+                other.started_at = now;
+                other.state = RelayTask::ACTIVE;
+                filters[num_filters++] = other.filters.get();
+                if (other.start_callback) {
+                    start_callbacks.push_back(other.start_callback);
+                }
+            }
+        }
+
         switch (task.type) {
             case RelayTask::REQUEST: {
-                auto req = client_message_req(task.subscription_id, task.filters.get(), &req_buffer);
+                auto req = client_message_req(task.subscription_id, filters, num_filters, &req_buffer);
                 printf("Request: %s\n", req);
                 platform_websocket_send(conn->socket, req);
                 conn->num_concurrent_requests++;
+                task.start_time = std::chrono::steady_clock::now();
+                if (task.start_callback) {
+                    start_callbacks.push_back(task.start_callback);
+                }
                 break;
             }
             case RelayTask::STREAM: {
-                auto req = client_message_req(task.subscription_id, task.filters.get(), &req_buffer);
+                auto req = client_message_req(task.subscription_id, filters, num_filters, &req_buffer);
                 printf("Request: %s\n", req);
                 platform_websocket_send(conn->socket, req);
                 break;
@@ -258,9 +485,11 @@ void process_tasks() {
                 auto req = client_message_event(task.event.get(), &req_buffer);
                 printf("Request: %s\n", req);
                 platform_websocket_send(conn->socket, req);
+                task.start_time = std::chrono::steady_clock::now();
                 break;
             }
         }
+        task.started_at = now;
         task.state = RelayTask::ACTIVE;
     }
 
@@ -271,6 +500,10 @@ void process_tasks() {
         }
     }
 
+    for (auto& start_callback : start_callbacks) {
+        start_callback();
+    }
+
 }
 
 void app_websocket_event(const AppWebsocketEvent* event) {
@@ -292,12 +525,13 @@ void app_websocket_event(const AppWebsocketEvent* event) {
     if (event->type == WEBSOCKET_OPEN) {
         printf("Websocket open: %s\n", relay_url);
         conn->state = RelayConnection::OPEN;
+        conn->num_failed_attempts = 0;
     } else if (event->type == WEBSOCKET_CLOSE) {
         printf("Websocket close: %s\n", relay_url);
-        conn->state = RelayConnection::CLOSED;
+        connection_lost(conn);
     } else if (event->type == WEBSOCKET_ERROR) {
         printf("Websocket error: %s\n", relay_url);
-        conn->state = RelayConnection::CLOSED;
+        connection_lost(conn);
     }
 
     if (event->type != WEBSOCKET_MESSAGE) {
@@ -311,11 +545,16 @@ void app_websocket_event(const AppWebsocketEvent* event) {
         return;
     }
 
-    uint8_t stack_buffer_data[event->data_length * 2];
-    StackBuffer stack_buffer(stack_buffer_data, event->data_length * 2);
+#ifdef PRIVAVIDA_BENCHMARKS
+    capture_message(event->data, event->data_length);
+#endif
 
+    StackBufferFixed<1024> stack_buffer;
+
+    // The platform hands us a scratch copy of the message (see platform.h),
+    // so we can parse it in place
     RelayMessage message;
-    if (!relay_message_parse(event->data, event->data_length, &stack_buffer, &message)) {
+    if (!relay_message_parse_insitu(event->data, event->data_length, &stack_buffer, &message)) {
         printf("message parse error\n");
         return;
     }
@@ -334,6 +573,9 @@ void app_websocket_event(const AppWebsocketEvent* event) {
             auto task = get_task_for_subscription_id(message.eose.subscription_id);
             if (!task || task->type != RelayTask::REQUEST) break;
 
+            // The backfill is done, so verify whatever is left in the batch
+            data_layer::receive_events_flush(relay_info->id);
+
             // For REQUEST tasks, upon receiving EOSE, we close the subscription
             StackBufferFixed<64> req_buffer;
             auto req = client_message_close(task->subscription_id, &req_buffer);
@@ -341,19 +583,68 @@ void app_websocket_event(const AppWebsocketEvent* event) {
             platform_websocket_send(conn->socket, req);
             conn->num_concurrent_requests--;
 
-            task->state = RelayTask::COMPLETED;
+            add_sample(&conn->stats.eose_seconds, conn->stats.num_requests, seconds_since(task->start_time));
+            conn->stats.num_requests++;
+
+            // Every task of the subscription is done. The callbacks are
+            // taken out first, as the tasks get removed.
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::pair<network::RequestCallback, double>> callbacks;
+            for (auto& other : tasks) {
+                if (other.state != RelayTask::ACTIVE || other.type != RelayTask::REQUEST ||
+                    other.relay_id != conn->relay_id || strcmp(other.subscription_id, message.eose.subscription_id) != 0) continue;
+
+                if (other.callback) {
+                    auto seconds = std::chrono::duration<double>(now - other.start_time).count();
+                    callbacks.push_back(std::make_pair(std::move(other.callback), seconds));
+                }
+                other.state = RelayTask::COMPLETED;
+            }
             process_tasks();
+
+            for (auto& callback : callbacks) {
+                callback.first(callback.second);
+            }
             break;
         }
         case RelayMessage::EVENT: {
-            Event* nostr_event;
-            ParseError err = event_parse(message.event.input, message.event.input_len, &stack_buffer, &nostr_event);
-            if (err) {
-                printf("event invalid (parse error): %d\n", (int)err);
+            // The event was parsed along with the message
+            auto nostr_event = message.event.event;
+            if (!nostr_event) {
+                printf("event invalid (parse error): %d\n", (int)message.event.err);
                 break;
             }
 
-            data_layer::receive_event(nostr_event, relay_info->id, event_time);
+            // Events for a REQUEST are part of a backfill (REQUEST tasks
+            // are completed on EOSE), so they can be verified in batches.
+            // As a subscription may be shared by several tasks, we find
+            // the ones the event is for by matching their filters.
+            // STREAM tasks keep track of the newest event they got, to
+            // resubscribe from if the connection drops.
+            bool backfill = false;
+            for (auto& task : tasks) {
+                if (task.state != RelayTask::ACTIVE || task.type == RelayTask::PUBLISH ||
+                    task.relay_id != conn->relay_id ||
+                    strcmp(task.subscription_id, message.event.subscription_id) != 0 ||
+                    !filters_match(task.filters.get(), nostr_event)) continue;
+
+                if (task.type == RelayTask::REQUEST) {
+                    backfill = true;
+                    if (!task.got_event) {
+                        task.got_event = true;
+                        add_sample(&conn->stats.first_event_seconds, conn->stats.num_first_events, seconds_since(task.start_time));
+                        conn->stats.num_first_events++;
+                    }
+                } else if ((int64_t)nostr_event->created_at > task.newest_created_at) {
+                    task.newest_created_at = nostr_event->created_at;
+                }
+            }
+            conn->stats.num_events++;
+            if (data_layer::event_is_known(&nostr_event->id)) {
+                conn->stats.num_events_duplicate++;
+            }
+
+            data_layer::receive_event(nostr_event, relay_info->id, event_time, backfill); // Takes ownership
 
             break;
         }
@@ -364,6 +655,13 @@ void app_websocket_event(const AppWebsocketEvent* event) {
         case RelayMessage::OK: {
             printf("%s OK: %s - %s\n", relay_url, message.ok.ok ? "true" : "false", message.ok.message);
             auto task = get_task_for_event_id(&message.ok.event_id);
+            if (task && task->relay_id == conn->relay_id && task->state == RelayTask::ACTIVE) {
+                add_sample(&conn->stats.ok_seconds, conn->stats.num_published, seconds_since(task->start_time));
+                conn->stats.num_published++;
+            }
+            if (!message.ok.ok) {
+                conn->stats.num_errors++;
+            }
             if (task) {
                 // @TODO: handle publish errors
                 task->state = RelayTask::COMPLETED;
@@ -374,6 +672,41 @@ void app_websocket_event(const AppWebsocketEvent* event) {
     }
 }
 
+const network::RelayStats* network::relay_stats(RelayId relay_id) {
+    auto conn = get_connection_for_relay(relay_id);
+    return conn ? &conn->stats : NULL;
+}
+
+// Lower is better. The latency is multiplied up by the share of errors
+// and divided down by the share of events that were new to us. Relays
+// that haven't got to an EOSE yet get the given latency instead.
+static double relay_score(RelayId relay_id, double unmeasured_seconds) {
+    auto stats = network::relay_stats(relay_id);
+    if (!stats) return unmeasured_seconds / 1.25;
+
+    double seconds = stats->num_requests ? stats->eose_seconds : unmeasured_seconds;
+    double error_rate = (double)stats->num_errors / (stats->num_requests + stats->num_published + stats->num_errors + 1);
+    double new_rate = (stats->num_events - stats->num_events_duplicate + 1.0) / (stats->num_events + 1.0);
+    return seconds * (1.0 + 4.0 * error_rate) / (0.25 + new_rate);
+}
+
+void network::rank_relays(RelayId* relays, uint32_t num_relays) {
+    double total_seconds = 0.0;
+    int num_measured = 0;
+    for (uint32_t i = 0; i < num_relays; ++i) {
+        auto stats = relay_stats(relays[i]);
+        if (stats && stats->num_requests) {
+            total_seconds += stats->eose_seconds;
+            num_measured++;
+        }
+    }
+    double unmeasured_seconds = num_measured ? total_seconds / num_measured : 1.0;
+
+    std::stable_sort(relays, relays + num_relays, [unmeasured_seconds](RelayId a, RelayId b) {
+        return relay_score(a, unmeasured_seconds) < relay_score(b, unmeasured_seconds);
+    });
+}
+
 void network::fetch(const char* url, network::FetchCallback callback) {
     auto cb = new network::FetchCallback(std::move(callback));
     platform_http_request(url, cb);
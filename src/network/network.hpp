@@ -13,11 +13,49 @@
 
 namespace network {
 
-void relay_add_task_request(RelayId relay_id, const Filters* filters);
+// The callback (if given) is called once the relay has sent everything
+// it has for the request (i.e. on EOSE), with the time that took.
+// Requests to the same relay that start together share a subscription
+// (so the time is that of all of them together), unless they're
+// exclusive. The start callback (if given) is called whenever the REQ
+// actually goes out, which can be a while after the request was added
+// as it waits for a free request slot on the relay, and again if it's
+// resent after the connection dropped.
+typedef std::function<void(double seconds)> RequestCallback;
+typedef std::function<void()> StartCallback;
+typedef uint32_t TaskId;
+TaskId relay_add_task_request(RelayId relay_id, const Filters* filters, RequestCallback callback = nullptr, bool exclusive = false, StartCallback start_callback = nullptr);
+
+// Stops a request that hasn't finished yet (without calling its
+// callback), closing its subscription unless it's shared with others
+void relay_cancel_task(TaskId task_id);
 void relay_add_task_stream(RelayId relay_id,  const Filters* filters);
 void relay_add_task_publish(RelayId relay_id, const Event* event);
 void stop_all_tasks();
 
+// What we've seen of a relay since we first connected to it. The
+// latencies are moving averages, in seconds.
+struct RelayStats {
+    uint32_t num_requests;        // That got to EOSE
+    uint32_t num_first_events;    // Requests that got any event
+    double first_event_seconds;   // From REQ to the first EVENT
+    double eose_seconds;          // From REQ to EOSE
+    uint32_t num_published;       // That got an OK
+    double ok_seconds;            // From EVENT to OK
+    uint32_t num_errors;          // Dropped connections and rejected events
+    uint64_t num_events;
+    uint64_t num_events_duplicate; // Events we already had
+};
+
+// Returns NULL if we haven't connected to the relay yet
+const RelayStats* relay_stats(RelayId relay_id);
+
+// Sorts the relays best first, going by their stats: the quicker a relay
+// answers, the fewer errors it has, and the more of its events we didn't
+// already have from elsewhere, the better. Relays we haven't timed yet
+// are taken to be as quick as the average of the ones we have.
+void rank_relays(RelayId* relays, uint32_t num_relays);
+
 typedef std::function<void(bool error, int status_code, const uint8_t* data, uint32_t data_length)> FetchCallback;
 void fetch(const char* url, FetchCallback callback);
 
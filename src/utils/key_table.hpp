@@ -0,0 +1,165 @@
+//
+//  key_table.hpp
+//  privavida-core
+//
+
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "../models/keys.hpp"
+
+// KeyTable is an open-addressing hash table (linear probing) keyed by
+// one of our 32-byte key types (EventId, Pubkey).
+//
+// Event ids are SHA-256 hashes and pubkeys are x-only curve points, so
+// the keys are already uniformly distributed. That means we can skip
+// hashing altogether and just use the first 8 bytes of the key.
+//
+// Example usage:
+//
+//      KeyTable<EventId, EventLocator> events_by_id;
+//      events_by_id.insert(&event->id, event_loc);
+//
+//      auto event_loc = events_by_id.find(&event->id);
+//      if (event_loc) { ... }
+//
+
+template <typename K, typename V>
+struct KeyTable {
+
+    struct Slot {
+        K key;
+        V value;
+        bool used;
+    };
+
+    Slot* slots;
+    uint32_t capacity; // Always a power of 2 (or 0)
+    uint32_t size;
+
+    KeyTable() : slots(NULL), capacity(0), size(0) {}
+    ~KeyTable() {
+        free(slots);
+    }
+    KeyTable(KeyTable&&) = delete;
+    KeyTable(const KeyTable&) = delete;
+
+    V* find(const K* key) {
+        if (!size) return NULL;
+        uint32_t mask = capacity - 1;
+        for (uint32_t i = hash(key) & mask; slots[i].used; i = (i + 1) & mask) {
+            if (compare_keys(&slots[i].key, key)) {
+                return &slots[i].value;
+            }
+        }
+        return NULL;
+    }
+    const V* find(const K* key) const {
+        return const_cast<KeyTable*>(this)->find(key);
+    }
+    bool contains(const K* key) const {
+        return find(key) != NULL;
+    }
+
+    // Inserts the key if it isn't already in the table, and either
+    // way sets its value. Returns a pointer to the stored value.
+    V* insert(const K* key, V value) {
+        if ((size + 1) * 2 > capacity) {
+            grow(capacity ? capacity * 2 : 64);
+        }
+
+        uint32_t mask = capacity - 1;
+        uint32_t i = hash(key) & mask;
+        for (; slots[i].used; i = (i + 1) & mask) {
+            if (compare_keys(&slots[i].key, key)) {
+                slots[i].value = value;
+                return &slots[i].value;
+            }
+        }
+
+        slots[i].key = *key;
+        slots[i].value = value;
+        slots[i].used = true;
+        size++;
+        return &slots[i].value;
+    }
+
+    // Removes the key from the table. Instead of leaving tombstones we
+    // shift subsequent entries in the probe sequence back into the gap.
+    bool erase(const K* key) {
+        if (!size) return false;
+        uint32_t mask = capacity - 1;
+        uint32_t i = hash(key) & mask;
+        for (; slots[i].used; i = (i + 1) & mask) {
+            if (compare_keys(&slots[i].key, key)) break;
+        }
+        if (!slots[i].used) return false;
+
+        uint32_t gap = i;
+        for (uint32_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+            uint32_t home = hash(&slots[j].key) & mask;
+
+            // Can the entry at j move back into the gap? Only if its
+            // home slot isn't cyclically in the range (gap, j]
+            bool home_in_range = (gap <= j) ? (gap < home && home <= j) : (gap < home || home <= j);
+            if (!home_in_range) {
+                slots[gap] = slots[j];
+                gap = j;
+            }
+        }
+        slots[gap].used = false;
+        size--;
+        return true;
+    }
+
+    void clear() {
+        if (slots) {
+            memset(slots, 0, capacity * sizeof(Slot));
+        }
+        size = 0;
+    }
+
+    void reserve(uint32_t count) {
+        uint32_t capacity_wanted = capacity ? capacity : 64;
+        while (capacity_wanted < count * 2) {
+            capacity_wanted *= 2;
+        }
+        if (capacity_wanted > capacity) {
+            grow(capacity_wanted);
+        }
+    }
+
+    template <typename F>
+    void for_each(F fn) {
+        for (uint32_t i = 0; i < capacity; ++i) {
+            if (slots[i].used) {
+                fn(&slots[i].key, slots[i].value);
+            }
+        }
+    }
+
+private:
+    static uint32_t hash(const K* key) {
+        uint64_t h;
+        memcpy(&h, key->data, sizeof(h));
+        return (uint32_t)(h ^ (h >> 32));
+    }
+
+    void grow(uint32_t capacity_new) {
+        Slot* slots_old = slots;
+        uint32_t capacity_old = capacity;
+
+        slots = (Slot*)calloc(capacity_new, sizeof(Slot));
+        capacity = capacity_new;
+        size = 0;
+
+        for (uint32_t i = 0; i < capacity_old; ++i) {
+            if (slots_old[i].used) {
+                insert(&slots_old[i].key, slots_old[i].value);
+            }
+        }
+        free(slots_old);
+    }
+};
@@ -45,7 +45,9 @@ struct StackBuffer {
 
         if (data_is_on_stack) {
             void* data_heap = malloc(size_new);
-            memcpy(data_heap, data, size);
+            if (size) {
+                memcpy(data_heap, data, size);
+            }
             data = data_heap;
             size = size_new;
             data_is_on_stack = false;
@@ -0,0 +1,91 @@
+//
+//  worker_pool.cpp
+//  privavida-core
+//
+
+#include "worker_pool.hpp"
+#include <app.hpp>
+
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define WORKER_POOL_THREADS 0
+#else
+#define WORKER_POOL_THREADS 1
+#endif
+
+#if WORKER_POOL_THREADS
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#endif
+
+constexpr unsigned MAX_WORKER_THREADS = 4;
+
+struct Job {
+    std::function<void()> work;
+    std::function<void()> done;
+};
+
+#if WORKER_POOL_THREADS
+
+static std::mutex jobs_mutex;
+static std::condition_variable jobs_available;
+static std::deque<Job> jobs;
+static std::vector<std::thread> threads;
+
+static void worker_main() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex);
+            jobs_available.wait(lock, []() { return !jobs.empty(); });
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job.work();
+        app::set_immediate(std::move(job.done));
+    }
+}
+
+void worker_pool::init() {
+    if (!threads.empty()) return;
+
+    // Leave one core for the UI thread
+    unsigned num_threads = std::thread::hardware_concurrency();
+    num_threads = num_threads > 1 ? num_threads - 1 : 1;
+    num_threads = num_threads < MAX_WORKER_THREADS ? num_threads : MAX_WORKER_THREADS;
+
+    for (unsigned i = 0; i < num_threads; ++i) {
+        threads.emplace_back(worker_main);
+        threads.back().detach();
+    }
+}
+
+void worker_pool::run(std::function<void()> work, std::function<void()> done) {
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex);
+        jobs.push_back({ std::move(work), std::move(done) });
+    }
+    jobs_available.notify_one();
+}
+
+unsigned worker_pool::num_workers() {
+    return threads.empty() ? 1 : (unsigned)threads.size();
+}
+
+#else
+
+void worker_pool::init() {}
+
+unsigned worker_pool::num_workers() {
+    return 1;
+}
+
+void worker_pool::run(std::function<void()> work, std::function<void()> done) {
+    work();
+    app::set_immediate(std::move(done));
+}
+
+#endif
@@ -0,0 +1,30 @@
+//
+//  worker_pool.hpp
+//  privavida-core
+//
+
+#pragma once
+#include <functional>
+
+// The worker pool runs CPU-heavy jobs (signature verification, NIP-04
+// decryption, ...) off the UI thread.
+//
+// A job consists of two functions: `work` which is called on one of
+// the worker threads, and `done` which is called back on the UI thread
+// (via app::set_immediate) once `work` has finished. `work` must not
+// touch any of the app's state, it should only operate on the data it
+// has been given.
+//
+// On platforms without threads (i.e. web builds without pthreads) the
+// `work` function is called right away on the calling thread.
+
+namespace worker_pool {
+
+void init();
+void run(std::function<void()> work, std::function<void()> done);
+
+// The number of worker threads (1 when the work runs inline), for
+// splitting work up between them
+unsigned num_workers();
+
+}
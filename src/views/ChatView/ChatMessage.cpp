@@ -61,7 +61,13 @@ void ChatMessage::create(ChatMessage* message, EventLocator event_loc) {
     default_attr.action_id = -1;
 
     // Create our text_content
-    if (event->content_encryption != EVENT_CONTENT_DECRYPTED) {
+    if (data_layer::event_needs_decrypting(event)) {
+        strcpy(text_content, "Decrypting...");
+
+        default_attr.text_color = ui::color(0xffffff, 0.5);
+        message->text_attrs.push_back(default_attr);
+
+    } else if (event->content_encryption != EVENT_CONTENT_DECRYPTED) {
         strcpy(text_content, "Failed to decrypt");
 
         default_attr.text_color = COLOR_ERROR;
@@ -222,7 +228,7 @@ void ChatMessage::update(bool draw_bubble_tip) {
     NVGcolor gradient_top_color, gradient_bottom_color;
     float gradient_top_y, gradient_bottom_y;
     {
-        if (event->content_encryption == EVENT_CONTENT_DECRYPTED && author_is_me(event)) {
+        if (event->content_encryption != EVENT_CONTENT_DECRYPT_FAILED && author_is_me(event)) {
             gradient_top_color = gradient_bottom_color = COLOR_PRIMARY;
         } else {
             gradient_top_color = gradient_bottom_color = COLOR_SECONDARY;
@@ -77,9 +77,15 @@ void ChatView::update() {
         }
     }
 
-    // Update entries
-    if (conv.messages.size() != entries.size()) {
+    // Update entries. They're only all created anew when messages are
+    // added or removed, a message that got decrypted just has its own
+    // entry replaced once it's shown.
+    if (conv.messages.size() != entries.size() || conv.version != entries_version) {
+        for (auto entry : entries) {
+            ChatViewEntry::destroy(entry);
+        }
         entries.clear();
+        entries_version = conv.version;
         entries.reserve(conv.messages.size());
         for (auto& message : conv.messages) {
             entries.push_back(ChatViewEntry::create(&message));
@@ -88,6 +94,7 @@ void ChatView::update() {
 
     // ScrollView
     {
+        std::vector<int> outdated;
         SubView sub(0, HEADER_HEIGHT, ui::view.width, ui::keyboard_y() - HEADER_HEIGHT - composer.height());
         VirtualizedList::update(
             &virt_state,
@@ -98,10 +105,32 @@ void ChatView::update() {
                 return entries[i]->measure_height(ui::view.width, entry_before, entry_after);
             },
             [&](int i) {
+                // Only the messages being shown are decrypted ahead
+                // of the rest
+                auto& message = conv.messages[i];
+                if (message.type == data_layer::Message::DIRECT_MESSAGE) {
+                    data_layer::decrypt_event(message.event_loc);
+                }
+                if (entries[i]->is_outdated()) {
+                    outdated.push_back(i);
+                }
                 entries[i]->update();
             },
             []() {}
         );
+
+        // The height of the entries around a decrypted message doesn't
+        // depend on its content, so only its own is measured again
+        for (auto i : outdated) {
+            ChatViewEntry::destroy(entries[i]);
+            entries[i] = ChatViewEntry::create(&conv.messages[i]);
+            auto entry_before = i - 1 >= 0 ? entries[i - 1] : NULL;
+            auto entry_after  = i + 1 < entries.size() ? entries[i + 1] : NULL;
+            VirtualizedList::set_element_height(&virt_state, i, entries[i]->measure_height(ui::view.width, entry_before, entry_after));
+        }
+        if (!outdated.empty()) {
+            ui::redraw();
+        }
     }
 
     // Composer
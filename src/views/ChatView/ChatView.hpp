@@ -16,6 +16,7 @@ struct ChatView {
     int selected_idx = 0;
     VirtualizedList::State virt_state;
     std::vector<ChatViewEntry*> entries;
+    uint32_t entries_version = 0; // The conversation's version the entries were created from
     Composer composer;
 
     void update();
@@ -20,6 +20,7 @@ static bool a_moment_passed(const Event* earlier, const Event* later) {
 
 struct ChatViewEntryMessage : public ChatViewEntry {
     ChatMessage message;
+    const Event* event; // The one the message was created from
 };
 
 ChatViewEntry* ChatViewEntry::create(const data_layer::Message* message) {
@@ -27,6 +28,7 @@ ChatViewEntry* ChatViewEntry::create(const data_layer::Message* message) {
         auto entry = new ChatViewEntryMessage;
         entry->type = message->type;
         ChatMessage::create(&entry->message, message->event_loc);
+        entry->event = data_layer::event(message->event_loc);
         return entry;
     } else {
         auto entry = new ChatViewEntry;
@@ -35,6 +37,22 @@ ChatViewEntry* ChatViewEntry::create(const data_layer::Message* message) {
     }
 }
 
+void ChatViewEntry::destroy(ChatViewEntry* entry) {
+    if (entry->type == data_layer::Message::DIRECT_MESSAGE) {
+        delete (ChatViewEntryMessage*)entry;
+    } else {
+        delete entry;
+    }
+}
+
+// A direct message gets swapped out for its decrypted copy, after which
+// its entry has to be created anew
+bool ChatViewEntry::is_outdated() const {
+    if (type != data_layer::Message::DIRECT_MESSAGE) return false;
+    auto entry = (const ChatViewEntryMessage*)this;
+    return entry->event != data_layer::event(entry->message.event_loc);
+}
+
 float ChatViewEntry::measure_height(float width, const ChatViewEntry* entry_before, const ChatViewEntry* entry_after) {
     
     // We add spacing above if this is the first entry
@@ -14,6 +14,8 @@ struct ChatViewEntry {
     bool space_above, space_below;
 
     static ChatViewEntry* create(const data_layer::Message* message);
+    static void destroy(ChatViewEntry* entry);
+    bool is_outdated() const;
     float measure_height(float width, const ChatViewEntry* entry_before, const ChatViewEntry* entry_after);
     void update();
 
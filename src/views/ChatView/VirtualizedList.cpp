@@ -11,6 +11,15 @@ void VirtualizedList::clear_measurements(VirtualizedList::State* state) {
     state->offsets.clear();
 }
 
+// Changes the height of one element, without measuring the rest again
+void VirtualizedList::set_element_height(VirtualizedList::State* state, int index, float height) {
+    if (index + 1 >= state->offsets.size()) return;
+    float delta = height - (state->offsets[index + 1] - state->offsets[index]);
+    for (auto i = index + 1; i < state->offsets.size(); ++i) {
+        state->offsets[i] += delta;
+    }
+}
+
 void VirtualizedList::update(VirtualizedList::State* state, int number_of_elements,
                              std::function<float(int)> measure_element_height,
                              std::function<void(int)> update_element,
@@ -20,6 +20,7 @@ struct VirtualizedList {
     };
 
     static void clear_measurements(State* state);
+    static void set_element_height(State* state, int index, float height);
     static void update(State* state, int number_of_elements,
                        std::function<float(int)> measure_element_height,
                        std::function<void(int)> update_element,
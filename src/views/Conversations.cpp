@@ -62,15 +62,15 @@ void Conversations::update() {
     {
         SubView sub(0, HEADER_HEIGHT, ui::view.width, ui::keyboard_y() - HEADER_HEIGHT);
         ScrollView sv(&sv_state);
-        sv.inner_size(ui::view.width, data_layer::conversations.size() * BLOCK_HEIGHT).update();
+        sv.inner_size(ui::view.width, data_layer::conversations_sorted.size() * BLOCK_HEIGHT).update();
 
         int start_block = (int)(sv.state.scroll_y / BLOCK_HEIGHT);
         if (start_block < 0) start_block = 0;
         int end_block = start_block + (int)(sv.outer_height / BLOCK_HEIGHT) + 1;
 
-        for (int i = start_block; i <= end_block && i < data_layer::conversations.size(); ++i) {
+        for (int i = start_block; i <= end_block && i < data_layer::conversations_sorted.size(); ++i) {
 
-            int conversation_id = data_layer::conversations_sorted[data_layer::conversations.size() - i - 1];
+            int conversation_id = data_layer::conversations_sorted[data_layer::conversations_sorted.size() - i - 1];
             auto& conv = data_layer::conversations[conversation_id];
             auto profile = data_layer::get_or_request_profile(&conv.counterparty);
 
@@ -150,6 +150,10 @@ void Conversations::update() {
             } else if (!(event = data_layer::event(conv.messages.back().event_loc))) {
                 color = COLOR_SUBDUED;
                 strcpy(text, "Messages loading...");
+            } else if (data_layer::event_needs_decrypting(event)) {
+                color = COLOR_SUBDUED;
+                strcpy(text, "Decrypting...");
+                data_layer::decrypt_event(conv.messages.back().event_loc);
             } else if (event->content_encryption == EVENT_CONTENT_DECRYPTED) {
                 auto sent_by_me = compare_keys(&event->pubkey, &data_layer::current_account()->pubkey);
                 if (!sent_by_me) {